@@ -0,0 +1,158 @@
+/*
+ * File attribute cache source for mp3fs
+ *
+ * Copyright (C) 2021 K. Henriksson
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include "attr_cache.h"
+
+#include <cerrno>
+#include <utility>
+
+#include "mp3fs.h"
+
+namespace {
+
+/*
+ * Return true for errors which come from a shortage of resources rather than
+ * from the file, and are not worth remembering.
+ */
+bool is_transient_error(int result) {
+    return result == -EAGAIN || result == -EINTR || result == -EMFILE ||
+           result == -ENFILE || result == -ENOMEM;
+}
+
+}  // namespace
+
+bool AttrCache::get(const std::string& path, int* result, struct stat* st) {
+    if (params.attrcachesize == 0) {
+        return false;
+    }
+
+    std::unique_lock<std::mutex> l(mutex_);
+    auto it = entries_.find(path);
+    if (it == entries_.end()) {
+        return false;
+    }
+
+    const time_t now = time(nullptr);
+    const unsigned int timeout = it->second.result == -ENOENT
+                                     ? params.negativetimeout
+                                     : params.attrtimeout;
+    if (now - it->second.checked >= static_cast<time_t>(timeout)) {
+        if (it->second.source.empty()) {
+            erase(it);
+            return false;
+        }
+
+        // Check the source file without holding the lock.
+        const std::string source = it->second.source;
+        l.unlock();
+        time_t source_mtime = 0;
+        time_t dir_mtime = 0;
+        const bool found = GetMtimes(source, &source_mtime, &dir_mtime);
+        l.lock();
+
+        it = entries_.find(path);
+        if (it == entries_.end()) {
+            return false;
+        }
+        if (!found || it->second.source != source ||
+            it->second.source_mtime != source_mtime ||
+            it->second.dir_mtime != dir_mtime) {
+            erase(it);
+            return false;
+        }
+        it->second.checked = now;
+    }
+
+    lru_.splice(lru_.begin(), lru_, it->second.lru_pos);
+    *result = it->second.result;
+    *st = it->second.st;
+    return true;
+}
+
+void AttrCache::put(const std::string& path, int result,
+                    const struct stat& st, const std::string& source) {
+    if (params.attrcachesize == 0 || is_transient_error(result) ||
+        (result == -ENOENT && params.negativetimeout == 0)) {
+        return;
+    }
+
+    // The attributes are from the source file itself, so use its modified
+    // time from them, in case the file has changed since.
+    time_t source_mtime = 0;
+    time_t dir_mtime = 0;
+    if (!source.empty() && !GetMtimes(source, &source_mtime, &dir_mtime)) {
+        return;
+    }
+    source_mtime = st.st_mtime;
+
+    std::lock_guard<std::mutex> l(mutex_);
+    auto it = entries_.find(path);
+    if (it != entries_.end()) {
+        erase(it);
+    } else if (entries_.size() >= params.attrcachesize) {
+        erase(entries_.find(lru_.back()));
+    }
+
+    lru_.push_front(path);
+    Entry entry = {};
+    entry.result = result;
+    entry.st = st;
+    entry.source = source;
+    entry.source_mtime = source_mtime;
+    entry.dir_mtime = dir_mtime;
+    entry.checked = time(nullptr);
+    entry.lru_pos = lru_.begin();
+    entries_.insert(std::make_pair(path, std::move(entry)));
+}
+
+void AttrCache::remove(const std::string& path) {
+    std::lock_guard<std::mutex> l(mutex_);
+    auto it = entries_.find(path);
+    if (it != entries_.end()) {
+        erase(it);
+    }
+}
+
+void AttrCache::clear() {
+    std::lock_guard<std::mutex> l(mutex_);
+    entries_.clear();
+    lru_.clear();
+}
+
+/* Get the modified times of 'source' and of its directory. */
+bool AttrCache::GetMtimes(const std::string& source, time_t* source_mtime,
+                          time_t* dir_mtime) {
+    struct stat s = {};
+    struct stat dir_s = {};
+    if (lstat(source.c_str(), &s) == -1 ||
+        stat(source.substr(0, source.rfind('/')).c_str(), &dir_s) == -1) {
+        errno = 0;
+        return false;
+    }
+    *source_mtime = s.st_mtime;
+    *dir_mtime = dir_s.st_mtime;
+    return true;
+}
+
+/* Remove an entry. Assumes the cache is locked. */
+void AttrCache::erase(entry_map_t::iterator it) {
+    lru_.erase(it->second.lru_pos);
+    entries_.erase(it);
+}
@@ -0,0 +1,94 @@
+/*
+ * File attribute cache interface for mp3fs
+ *
+ * Copyright (C) 2021 K. Henriksson
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef MP3FS_ATTR_CACHE_H_
+#define MP3FS_ATTR_CACHE_H_
+
+#include <sys/stat.h>
+
+#include <cstddef>
+#include <ctime>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+/*
+ * Cache of getattr results, keyed by path inside the mp3fs mount. Failures
+ * are cached as well as attributes, so a missing file or a source which
+ * can't be decoded is not looked at again on every call.
+ *
+ * A result is trusted for attrtimeout seconds, or negativetimeout seconds if
+ * the file doesn't exist. After that, a result with a source file is kept as
+ * long as the modified times of the source file and its directory are
+ * unchanged. Checking the directory catches a file added beside the source
+ * which would now be used instead.
+ */
+class AttrCache {
+ public:
+    AttrCache() = default;
+    AttrCache(const AttrCache&) = delete;
+    AttrCache& operator=(const AttrCache&) = delete;
+
+    /*
+     * Get the cached result for 'path'. Returns false if there is no valid
+     * entry. Otherwise 'result' is the return value of getattr, and 'st' the
+     * attributes if it is 0.
+     */
+    bool get(const std::string& path, int* result, struct stat* st);
+
+    /*
+     * Store the result of getattr for 'path'. 'source' is the file the
+     * attributes came from, or empty if there is none.
+     */
+    void put(const std::string& path, int result, const struct stat& st,
+             const std::string& source);
+
+    /* Remove the entry for 'path', if there is one. */
+    void remove(const std::string& path);
+
+    /* Remove all entries. */
+    void clear();
+
+ private:
+    struct Entry {
+        int result;
+        struct stat st;
+        std::string source;
+        time_t source_mtime;
+        time_t dir_mtime;
+        // When the entry was stored or last checked against the source file.
+        time_t checked;
+        std::list<std::string>::iterator lru_pos;
+    };
+
+    using entry_map_t = std::unordered_map<std::string, Entry>;
+
+    static bool GetMtimes(const std::string& source, time_t* source_mtime,
+                          time_t* dir_mtime);
+    void erase(entry_map_t::iterator it);
+
+    std::mutex mutex_;
+    entry_map_t entries_;
+    // Paths with entries, most recently used first.
+    std::list<std::string> lru_;
+};
+
+#endif  // MP3FS_ATTR_CACHE_H_
@@ -20,71 +20,461 @@
 
 #include "buffer.h"
 
+#include <fcntl.h>
+#include <unistd.h>
+
 #include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <new>
 #include <ostream>
+#include <string>
 
 #include "logging.h"
+#include "mp3fs.h"
+
+namespace {
+
+constexpr size_t kBytesPerMegabyte = 1024 * 1024;
+
+/*
+ * Chunks released by Buffers, kept for reuse so many Buffers growing and
+ * being freed don't fragment the heap. At most kMaxFreeChunks are kept.
+ */
+constexpr size_t kMaxFreeChunks = 64;
+std::vector<uint8_t*> free_chunks;
+std::mutex free_chunks_mutex;
+
+/*
+ * The number of chunks in memory across all Buffers, and the lock for the
+ * ring of those chunks. The memory budget is in chunks, and 0 means there is
+ * no limit.
+ */
+std::atomic<size_t> resident_chunks {0};
+std::mutex ring_mutex;
+
+size_t budget_chunks() {
+    return static_cast<size_t>(params.membudget) * kBytesPerMegabyte /
+           Buffer::kChunkSize;
+}
+
+uint8_t* allocate_chunk() {
+    {
+        std::lock_guard<std::mutex> l(free_chunks_mutex);
+        if (!free_chunks.empty()) {
+            uint8_t* chunk = free_chunks.back();
+            free_chunks.pop_back();
+            return chunk;
+        }
+    }
+    return new (std::nothrow) uint8_t[Buffer::kChunkSize];
+}
+
+void release_chunk(uint8_t* chunk) {
+    {
+        std::lock_guard<std::mutex> l(free_chunks_mutex);
+        if (free_chunks.size() < kMaxFreeChunks) {
+            free_chunks.push_back(chunk);
+            return;
+        }
+    }
+    delete[] chunk;
+}
+
+/* Free all pooled chunks, when memory is short. */
+void clear_free_chunks() {
+    std::lock_guard<std::mutex> l(free_chunks_mutex);
+    for (uint8_t* chunk : free_chunks) {
+        delete[] chunk;
+    }
+    free_chunks.clear();
+}
+
+/* Create an unlinked temporary file to hold spilled chunks. */
+int create_spill_file() {
+    const char* tmpdir = getenv("TMPDIR");
+    std::string path = std::string(tmpdir != nullptr ? tmpdir : "/tmp") +
+                       "/mp3fs-spill.XXXXXX";
+    int fd = mkstemp(&path[0]);
+    if (fd == -1) {
+        Log(ERROR) << "Failed to create buffer spill file: " << strerror(errno);
+        errno = 0;
+        return -1;
+    }
+    unlink(path.c_str());
+    return fd;
+}
+
+}  // namespace
+
+constexpr size_t Buffer::kChunkSize;
+Buffer::Chunk* Buffer::clock_hand_ = nullptr;
+
+Buffer::Buffer() = default;
+
+/*
+ * The chunks are taken out of the ring first, so another Buffer enforcing
+ * the budget can't spill them meanwhile.
+ */
+Buffer::~Buffer() {
+    {
+        std::lock_guard<std::mutex> l(ring_mutex);
+        for (Chunk& chunk : chunks_) {
+            UnlinkChunk(&chunk);
+        }
+    }
+    for (Chunk& chunk : chunks_) {
+        drop_chunk(&chunk);
+    }
+    if (spill_fd_ != -1) {
+        close(spill_fd_);
+    }
+}
 
 void Buffer::write(const std::vector<uint8_t>& data, bool extend_buffer) {
-    main_data_.insert(main_data_.end(), data.begin(), data.end());
-    if (main_data_.size() > static_cast<size_t>(end_offset_)) {
+    std::lock_guard<std::mutex> l(mutex_);
+    store(data.data(), data.size(), main_size_);
+    if (main_size_ > static_cast<size_t>(end_offset_)) {
         if (extend_buffer) {
-            end_offset_ = static_cast<std::ptrdiff_t>(main_data_.size());
+            end_offset_ = static_cast<std::ptrdiff_t>(main_size_);
         } else {
-            main_data_.resize(end_offset_);
+            resize_main(static_cast<size_t>(end_offset_));
         }
     }
 }
 
 void Buffer::write_to(const std::vector<uint8_t>& data, std::ptrdiff_t offset) {
-    std::copy(data.begin(), data.end(), main_data_.begin() + offset);
+    std::lock_guard<std::mutex> l(mutex_);
+    store(data.data(), data.size(), static_cast<size_t>(offset));
 }
 
 void Buffer::write_end(const std::vector<uint8_t>& data,
                        std::ptrdiff_t offset) {
+    std::lock_guard<std::mutex> l(mutex_);
     end_data_ = data;
     end_offset_ = offset;
 }
 
+size_t Buffer::tell() const {
+    std::lock_guard<std::mutex> l(mutex_);
+    return main_size_;
+}
+
+size_t Buffer::size() const {
+    std::lock_guard<std::mutex> l(mutex_);
+    return locked_size();
+}
+
 void Buffer::copy_into(uint8_t* out_data, std::ptrdiff_t offset,
                        size_t size) const {
-    if (!valid_bytes(offset, size)) {
+    std::lock_guard<std::mutex> l(mutex_);
+    if (!locked_valid_bytes(offset, size)) {
         Log(ERROR) << "Invalid offset=" << offset << " size=" << size
                    << " in Buffer::copy_into.";
         return;
     }
-    if (offset + size <= main_data_.size()) {
-        std::copy_n(main_data_.begin() + offset, size, out_data);
-    } else if (offset >= end_offset_) {
-        std::copy_n(end_data_.begin() + offset - end_offset_, size, out_data);
-    } else {
-        size_t start_size = main_data_.size() - offset;
-        uint8_t* next =
-            std::copy_n(main_data_.begin() + offset, start_size, out_data);
-        std::copy_n(end_data_.begin(), size - start_size, next);
+    locked_copy_into(out_data, offset, size);
+}
+
+bool Buffer::copy_valid(uint8_t* out_data, std::ptrdiff_t offset,
+                        size_t size) const {
+    std::lock_guard<std::mutex> l(mutex_);
+    if (!locked_valid_bytes(offset, size)) {
+        return false;
     }
+    locked_copy_into(out_data, offset, size);
+    return true;
+}
+
+/*
+ * Chunks are brought into memory one at a time, so the Buffer is pinned first
+ * to keep bringing in a later chunk from spilling an earlier one.
+ */
+bool Buffer::visit_valid(
+    std::ptrdiff_t offset, size_t size,
+    const std::function<void(const std::vector<struct iovec>&)>& visit) const {
+    std::lock_guard<std::mutex> l(mutex_);
+    if (!locked_valid_bytes(offset, size)) {
+        return false;
+    }
+
+    pinned_ = true;
+    std::vector<struct iovec> spans;
+    auto pos = static_cast<size_t>(offset);
+    size_t main_bytes = 0;
+    if (offset + size <= main_size_) {
+        main_bytes = size;
+    } else if (offset < end_offset_) {
+        main_bytes = main_size_ - pos;
+    }
+    for (size_t left = main_bytes; left > 0;) {
+        const size_t chunk_offset = pos % kChunkSize;
+        const size_t n = std::min(left, kChunkSize - chunk_offset);
+        spans.push_back(
+            {chunk_data(pos / kChunkSize, false) + chunk_offset, n});
+        pos += n;
+        left -= n;
+    }
+    if (main_bytes < size) {
+        // The main segment ends where the end segment starts.
+        const size_t end_pos =
+            main_bytes > 0 ? 0 : pos - static_cast<size_t>(end_offset_);
+        spans.push_back({const_cast<uint8_t*>(end_data_.data()) + end_pos,
+                         size - main_bytes});
+    }
+    visit(spans);
+    pinned_ = false;
+    return true;
 }
 
 bool Buffer::valid_bytes(std::ptrdiff_t offset, size_t size) const {
-    size_t end = offset + size;
-    return offset >= 0 && end <= this->size() &&
-           (end <= main_data_.size() || offset >= end_offset_ ||
-            main_data_.size() == static_cast<size_t>(end_offset_));
+    std::lock_guard<std::mutex> l(mutex_);
+    return locked_valid_bytes(offset, size);
 }
 
 size_t Buffer::max_valid_bytes(std::ptrdiff_t offset) const {
-    if (static_cast<size_t>(offset) > size()) {
+    std::lock_guard<std::mutex> l(mutex_);
+    if (static_cast<size_t>(offset) > locked_size()) {
         return 0;
     }
-    if (main_data_.size() == static_cast<size_t>(end_offset_) ||
+    if (main_size_ == static_cast<size_t>(end_offset_) ||
         offset >= end_offset_) {
         // In either case, the whole rest of the Buffer is valid.
-        return size() - offset;
+        return locked_size() - offset;
     }
-    if (static_cast<size_t>(offset) <= main_data_.size()) {
+    if (static_cast<size_t>(offset) <= main_size_) {
         // In this case, everything to the end of the main segment is valid.
-        return main_data_.size() - offset;
+        return main_size_ - offset;
     }
     // The offset is between the main and end segments, so nothing is valid.
     return 0;
 }
+
+void Buffer::extend() {
+    std::lock_guard<std::mutex> l(mutex_);
+    resize_main(static_cast<size_t>(end_offset_));
+}
+
+void Buffer::truncate() {
+    std::lock_guard<std::mutex> l(mutex_);
+    end_offset_ = static_cast<std::ptrdiff_t>(main_size_);
+}
+
+bool Buffer::locked_valid_bytes(std::ptrdiff_t offset, size_t size) const {
+    size_t end = offset + size;
+    return offset >= 0 && end <= locked_size() &&
+           (end <= main_size_ || offset >= end_offset_ ||
+            main_size_ == static_cast<size_t>(end_offset_));
+}
+
+void Buffer::locked_copy_into(uint8_t* out_data, std::ptrdiff_t offset,
+                              size_t size) const {
+    if (offset + size <= main_size_) {
+        load(out_data, static_cast<size_t>(offset), size);
+    } else if (offset >= end_offset_) {
+        std::copy_n(end_data_.begin() + offset - end_offset_, size, out_data);
+    } else {
+        size_t start_size = main_size_ - offset;
+        load(out_data, static_cast<size_t>(offset), start_size);
+        std::copy_n(end_data_.begin(), size - start_size,
+                    out_data + start_size);
+    }
+}
+
+void Buffer::store(const uint8_t* data, size_t size, size_t offset) {
+    if (offset + size > main_size_) {
+        resize_main(offset + size);
+    }
+
+    while (size > 0) {
+        const size_t chunk_offset = offset % kChunkSize;
+        const size_t n = std::min(size, kChunkSize - chunk_offset);
+        std::copy_n(data, n,
+                    chunk_data(offset / kChunkSize, true) + chunk_offset);
+        data += n;
+        offset += n;
+        size -= n;
+    }
+}
+
+void Buffer::load(uint8_t* out_data, size_t offset, size_t size) const {
+    while (size > 0) {
+        const size_t chunk_offset = offset % kChunkSize;
+        const size_t n = std::min(size, kChunkSize - chunk_offset);
+        out_data = std::copy_n(
+            chunk_data(offset / kChunkSize, false) + chunk_offset, n, out_data);
+        offset += n;
+        size -= n;
+    }
+}
+
+/*
+ * Chunks past the old end are added without memory and read as zero, so only
+ * the rest of a partly used last chunk has to be cleared.
+ */
+void Buffer::resize_main(size_t size) {
+    if (size > main_size_ && main_size_ % kChunkSize != 0) {
+        const size_t chunk_offset = main_size_ % kChunkSize;
+        const size_t n = std::min(size - main_size_, kChunkSize - chunk_offset);
+        memset(chunk_data(main_size_ / kChunkSize, true) + chunk_offset, 0, n);
+    }
+    set_chunk_count(size);
+    main_size_ = size;
+}
+
+void Buffer::set_chunk_count(size_t size) {
+    const size_t chunk_count = (size + kChunkSize - 1) / kChunkSize;
+    while (chunks_.size() > chunk_count) {
+        drop_chunk(&chunks_.back());
+        chunks_.pop_back();
+    }
+    chunks_.resize(chunk_count);
+}
+
+uint8_t* Buffer::chunk_data(size_t index, bool modify) const {
+    Chunk& chunk = chunks_[index];
+    chunk.referenced = true;
+
+    if (chunk.data == nullptr) {
+        if (budget_chunks() > 0 && resident_chunks >= budget_chunks()) {
+            enforce_budget(this);
+        }
+        chunk.data = allocate_chunk();
+        if (chunk.data == nullptr) {
+            // Out of memory: give back what can be spared and try again.
+            clear_free_chunks();
+            enforce_budget(this);
+            chunk.data = new uint8_t[kChunkSize];
+        }
+        ++resident_chunks;
+        if (budget_chunks() > 0) {
+            chunk.owner = this;
+            chunk.index = index;
+            std::lock_guard<std::mutex> l(ring_mutex);
+            LinkChunk(&chunk);
+        }
+
+        const auto file_offset = static_cast<off_t>(index * kChunkSize);
+        if (!chunk.on_disk) {
+            memset(chunk.data, 0, kChunkSize);
+        } else if (pread(spill_fd_, chunk.data, kChunkSize, file_offset) !=
+                   static_cast<ssize_t>(kChunkSize)) {
+            Log(ERROR) << "Failed to read buffer spill file: "
+                       << strerror(errno);
+            errno = 0;
+            memset(chunk.data, 0, kChunkSize);
+        }
+    }
+
+    // A modified chunk must be written out again to be spilled.
+    if (modify) {
+        chunk.on_disk = false;
+    }
+    return chunk.data;
+}
+
+void Buffer::drop_chunk(Chunk* chunk) const {
+    if (chunk->data != nullptr) {
+        if (budget_chunks() > 0) {
+            std::lock_guard<std::mutex> l(ring_mutex);
+            UnlinkChunk(chunk);
+        }
+        release_chunk(chunk->data);
+        chunk->data = nullptr;
+        --resident_chunks;
+    }
+}
+
+bool Buffer::spill_chunk(Chunk* chunk) const {
+    if (!chunk->on_disk) {
+        if (spill_fd_ == -1) {
+            spill_fd_ = create_spill_file();
+        }
+        const auto file_offset =
+            static_cast<off_t>(chunk->index * kChunkSize);
+        if (spill_fd_ == -1 ||
+            pwrite(spill_fd_, chunk->data, kChunkSize, file_offset) !=
+                static_cast<ssize_t>(kChunkSize)) {
+            Log(ERROR) << "Failed to write buffer spill file: "
+                       << strerror(errno);
+            errno = 0;
+            return false;
+        }
+        chunk->on_disk = true;
+    }
+    release_chunk(chunk->data);
+    chunk->data = nullptr;
+    --resident_chunks;
+    return true;
+}
+
+/*
+ * The clock hand goes around the ring, giving each chunk which was used since
+ * it last passed a second chance, and spilling the first one which wasn't.
+ * Other Buffers are only locked with try_lock, so two Buffers enforcing the
+ * budget at the same time can't deadlock. Chunks of Buffers in use by another
+ * thread are skipped. If nothing can be spilled after going around twice,
+ * the budget is exceeded rather than failing the write.
+ */
+void Buffer::enforce_budget(const Buffer* self) {
+    std::lock_guard<std::mutex> l(ring_mutex);
+    for (size_t steps = 2 * resident_chunks + 1;
+         steps > 0 && clock_hand_ != nullptr &&
+         resident_chunks >= budget_chunks();
+         --steps) {
+        Chunk* chunk = clock_hand_;
+        const Buffer* owner = chunk->owner;
+        if (owner == self ? self->pinned_ : !owner->mutex_.try_lock()) {
+            clock_hand_ = chunk->next;
+            continue;
+        }
+
+        bool spilled = true;
+        if (chunk->referenced) {
+            chunk->referenced = false;
+            clock_hand_ = chunk->next;
+        } else {
+            UnlinkChunk(chunk);
+            spilled = owner->spill_chunk(chunk);
+            if (!spilled) {
+                LinkChunk(chunk);
+            }
+        }
+        if (owner != self) {
+            owner->mutex_.unlock();
+        }
+        if (!spilled) {
+            break;
+        }
+    }
+}
+
+void Buffer::LinkChunk(Chunk* chunk) {
+    if (clock_hand_ == nullptr) {
+        chunk->prev = chunk->next = chunk;
+        clock_hand_ = chunk;
+        return;
+    }
+    chunk->next = clock_hand_;
+    chunk->prev = clock_hand_->prev;
+    chunk->prev->next = chunk;
+    clock_hand_->prev = chunk;
+}
+
+void Buffer::UnlinkChunk(Chunk* chunk) {
+    if (chunk->next == nullptr) {
+        return;
+    }
+    if (chunk->next == chunk) {
+        clock_hand_ = nullptr;
+    } else {
+        chunk->prev->next = chunk->next;
+        chunk->next->prev = chunk->prev;
+        if (clock_hand_ == chunk) {
+            clock_hand_ = chunk->next;
+        }
+    }
+    chunk->prev = chunk->next = nullptr;
+}
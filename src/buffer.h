@@ -21,14 +21,36 @@
 #ifndef MP3FS_BUFFER_H_
 #define MP3FS_BUFFER_H_
 
+#include <sys/uio.h>
+
 #include <cstddef>
 #include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
 #include <vector>
 
+/*
+ * Output file data. The main segment holds data written from the start of the
+ * file, and the end segment holds data written at the end, such as a trailing
+ * tag. The main segment is stored in fixed size chunks, so it never has to be
+ * moved as it grows, and chunks are reused between Buffers.
+ *
+ * With the membudget option, the memory used by chunks of all Buffers is
+ * limited. When it is reached, chunks which have not been used recently are
+ * written to a temporary file and read back when they are next needed. They
+ * are chosen with the clock algorithm, which takes constant time on average.
+ *
+ * A Buffer can be read while it is being written to. Each method sees the
+ * Buffer either before or after each write, so bytes which are valid have
+ * been written.
+ */
 class Buffer {
  public:
-    Buffer() = default;
-    ~Buffer() = default;
+    Buffer();
+    ~Buffer();
+    Buffer(const Buffer&) = delete;
+    Buffer& operator=(const Buffer&) = delete;
 
     /**
      * Write data to the end of the Buffer's main segment.
@@ -58,12 +80,12 @@ class Buffer {
     /**
      * Give the size of data already written in the main segment.
      */
-    size_t tell() const { return main_data_.size(); }
+    size_t tell() const;
 
     /**
      * Retrieve the total size of the buffer.
      */
-    size_t size() const { return end_offset_ + end_data_.size(); }
+    size_t size() const;
 
     /**
      * Copy data of the given size and at the given offset from the buffer to
@@ -73,13 +95,31 @@ class Buffer {
      */
     void copy_into(uint8_t* out_data, std::ptrdiff_t offset, size_t size) const;
 
+    /**
+     * Copy data like copy_into, if the whole range is valid. Returns whether
+     * it was.
+     */
+    bool copy_valid(uint8_t* out_data, std::ptrdiff_t offset,
+                    size_t size) const;
+
+    /**
+     * If the whole range is valid, pass it to 'visit' as the spans of memory
+     * holding it, in order, without copying it. The Buffer stays locked and
+     * its chunks stay in memory until 'visit' returns, so it must not keep the
+     * spans or use the Buffer. Returns whether the range was valid.
+     */
+    bool visit_valid(
+        std::ptrdiff_t offset, size_t size,
+        const std::function<void(const std::vector<struct iovec>&)>& visit)
+        const;
+
     /**
      * Return whether the given number of bytes at the given offset are valid
      * (have been already filled).
      *
-     * Bytes are valid if the range lies fully within main_data_, fully within
-     * end_data_ (subject to end_offset_), or overlaps the two and
-     * main_data_.size() == end_offset_.
+     * Bytes are valid if the range lies fully within the main segment, fully
+     * within end_data_ (subject to end_offset_), or overlaps the two and
+     * the main segment ends at end_offset_.
      */
     bool valid_bytes(std::ptrdiff_t offset, size_t size) const;
 
@@ -92,17 +132,104 @@ class Buffer {
     /**
      * Move end of main segment to start of end segment.
      */
-    void extend() { main_data_.resize(end_offset_); }
+    void extend();
 
     /**
      * Move end segment to end of main segment.
      */
-    void truncate() {
-        end_offset_ = static_cast<std::ptrdiff_t>(main_data_.size());
-    }
+    void truncate();
+
+    /** Size of each chunk of the main segment. */
+    static constexpr size_t kChunkSize = 256 * 1024;
 
  private:
-    std::vector<uint8_t> main_data_;
+    /*
+     * A chunk of the main segment. If data is null, the chunk is in the spill
+     * file if on_disk is set, and all zero otherwise. If both are set, the
+     * spill file holds an up to date copy, so the chunk can be dropped
+     * without writing it again.
+     *
+     * With a memory budget, chunks in memory are linked into a ring shared by
+     * all Buffers, which the clock hand goes around to find chunks to spill.
+     */
+    struct Chunk {
+        uint8_t* data = nullptr;
+        bool on_disk = false;
+        // Set when the chunk is used, and cleared when the clock hand passes.
+        bool referenced = false;
+        const Buffer* owner = nullptr;
+        size_t index = 0;
+        // Neighbours in the ring, or null if the chunk is not in it.
+        Chunk* prev = nullptr;
+        Chunk* next = nullptr;
+    };
+
+    /**
+     * Copy data into the main segment at the given offset, growing it if the
+     * data goes past its end. Assumes the Buffer is locked.
+     */
+    void store(const uint8_t* data, size_t size, size_t offset);
+
+    /** Copy data out of the main segment. Assumes the Buffer is locked. */
+    void load(uint8_t* out_data, size_t offset, size_t size) const;
+
+    /**
+     * Change the size of the main segment. Added bytes are zero. Assumes the
+     * Buffer is locked.
+     */
+    void resize_main(size_t size);
+
+    /** Versions of the public methods which assume the Buffer is locked. */
+    size_t locked_size() const { return end_offset_ + end_data_.size(); }
+    bool locked_valid_bytes(std::ptrdiff_t offset, size_t size) const;
+    void locked_copy_into(uint8_t* out_data, std::ptrdiff_t offset,
+                          size_t size) const;
+
+    /** Add or free chunks so there are just enough for size bytes. */
+    void set_chunk_count(size_t size);
+
+    /**
+     * Return the data of the given chunk, bringing it into memory if needed,
+     * and mark it as used. Assumes the Buffer is locked.
+     */
+    uint8_t* chunk_data(size_t index, bool modify) const;
+
+    /** Free the memory of a chunk. Assumes the Buffer is locked. */
+    void drop_chunk(Chunk* chunk) const;
+
+    /**
+     * Move a chunk to the spill file, unless it already has a copy there.
+     * Assumes the Buffer and the ring are locked, and the chunk has been
+     * taken out of the ring.
+     */
+    bool spill_chunk(Chunk* chunk) const;
+
+    /**
+     * Spill chunks of any Buffer which have not been used recently until the
+     * memory budget allows another chunk. Assumes self is locked, and leaves
+     * its chunks in memory if it is pinned.
+     */
+    static void enforce_budget(const Buffer* self);
+
+    /**
+     * Add a chunk to the ring, just behind the clock hand, or remove it.
+     * Assume the ring is locked.
+     */
+    static void LinkChunk(Chunk* chunk);
+    static void UnlinkChunk(Chunk* chunk);
+
+    // The next chunk in the ring to be checked, or null if it is empty.
+    static Chunk* clock_hand_;
+
+    // Chunks are brought back from the spill file when reading, so they can
+    // change in const methods. The contents of the Buffer never do. The
+    // chunks are never moved, since the ring points to them.
+    mutable std::deque<Chunk> chunks_;
+    mutable int spill_fd_ = -1;
+    mutable std::mutex mutex_;
+    // Set while spans of the chunks are handed out, so they aren't spilled.
+    mutable bool pinned_ = false;
+    size_t main_size_ = 0;
     std::vector<uint8_t> end_data_;
     std::ptrdiff_t end_offset_ = 0;
 };
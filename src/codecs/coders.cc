@@ -20,9 +20,15 @@
 
 #include "codecs/coders.h"
 
-#include <algorithm>
-#include <cctype>
+#include <strings.h>
+
+#include <map>
 #include <memory>
+#include <mutex>
+#include <typeindex>
+#include <typeinfo>
+#include <utility>
+#include <vector>
 
 /*
  * Conditionally include specific encoders and decoders based on
@@ -47,9 +53,60 @@
 #include "mp3fs.h"
 
 namespace {
+
 constexpr double kDefaultGain = 89.0;
+
+// Most Decoders of each type kept for reuse.
+constexpr size_t kMaxPooledDecoders = 8;
+
+template <typename T>
+std::unique_ptr<Decoder> make_decoder() {
+    return std::unique_ptr<Decoder>(new T());
 }
 
+template <typename T>
+std::type_index decoder_class() {
+    return typeid(T);
+}
+
+/* Decoders given back with Decoder::Recycle(), by class. */
+std::map<std::type_index, std::vector<std::unique_ptr<Decoder>>> decoder_pools;
+std::mutex decoder_pools_mutex;
+
+/*
+ * The file types which can be decoded. Looking up a type only compares
+ * strings, and a Decoder is created only when one is needed, since creating
+ * one can set up most of the decoding library.
+ */
+struct DecoderType {
+    const char* file_type;
+    std::unique_ptr<Decoder> (*create)();
+    std::type_index (*decoder_class)();
+};
+
+constexpr DecoderType kDecoderTypes[] = {
+#ifdef HAVE_FLAC
+    {"flac", make_decoder<FlacDecoder>, decoder_class<FlacDecoder>},
+#endif
+#ifdef HAVE_VORBIS
+    {"oga", make_decoder<VorbisDecoder>, decoder_class<VorbisDecoder>},
+    {"ogg", make_decoder<VorbisDecoder>, decoder_class<VorbisDecoder>},
+#endif
+    {nullptr, nullptr, nullptr},
+};
+
+const DecoderType* find_decoder_type(const char* file_type) {
+    for (const DecoderType* type = kDecoderTypes; type->file_type != nullptr;
+         ++type) {
+        if (strcasecmp(type->file_type, file_type) == 0) {
+            return type;
+        }
+    }
+    return nullptr;
+}
+
+}  // namespace
+
 void Encoder::set_gain(double gainref, double album_gain, double track_gain) {
     if (gainref == kInvalidDb) {
         gainref = kDefaultGain;
@@ -85,21 +142,39 @@ std::unique_ptr<Encoder> Encoder::CreateEncoder(const std::string& file_type,
 }
 
 /* Create instance of class derived from Decoder. */
-std::unique_ptr<Decoder> Decoder::CreateDecoder(std::string file_type) {
-    // Convert file type to lowercase.
-    std::transform(file_type.begin(), file_type.end(), file_type.begin(),
-                   [](unsigned char c) { return std::tolower(c); });
-#ifdef HAVE_FLAC
-    if (file_type == "flac") {
-        return std::unique_ptr<Decoder>(new FlacDecoder());
+std::unique_ptr<Decoder> Decoder::CreateDecoder(const char* file_type) {
+    const DecoderType* type = find_decoder_type(file_type);
+    if (type == nullptr) {
+        return nullptr;
     }
-#endif
-#ifdef HAVE_VORBIS
-    if (file_type == "ogg" || file_type == "oga") {
-        return std::unique_ptr<Decoder>(new VorbisDecoder());
+
+    {
+        std::lock_guard<std::mutex> l(decoder_pools_mutex);
+        auto it = decoder_pools.find(type->decoder_class());
+        if (it != decoder_pools.end() && !it->second.empty()) {
+            std::unique_ptr<Decoder> decoder = std::move(it->second.back());
+            it->second.pop_back();
+            return decoder;
+        }
     }
-#endif
-    return nullptr;
+    return type->create();
+}
+
+void Decoder::Recycle(std::unique_ptr<Decoder> decoder) {
+    if (!decoder || !decoder->close_file()) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> l(decoder_pools_mutex);
+    std::vector<std::unique_ptr<Decoder>>& pool =
+        decoder_pools[std::type_index(typeid(*decoder))];
+    if (pool.size() < kMaxPooledDecoders) {
+        pool.push_back(std::move(decoder));
+    }
+}
+
+bool Decoder::CanDecode(const char* file_type) {
+    return find_decoder_type(file_type) != nullptr;
 }
 
 void print_codec_versions(std::ostream& out) {
@@ -21,11 +21,13 @@
 #ifndef MP3FS_CODECS_CODERS_H_
 #define MP3FS_CODECS_CODERS_H_
 
+#include <cstddef>
 #include <cstdint>
 #include <ctime>
 #include <memory>
 #include <ostream>
 #include <string>
+#include <vector>
 
 class Buffer;
 
@@ -80,9 +82,64 @@ class Encoder {
 
     virtual bool no_partial_encode() { return true; }
 
+    /*
+     * Get the range of the output which is only written once encoding is
+     * finished, such as a header with totals for the whole file. If the
+     * output can be read partially, everything else can be read as soon as
+     * it is written, and reads of this range wait for the end.
+     */
+    virtual void final_range(size_t* offset, size_t* size) const {
+        *offset = 0;
+        *size = 0;
+    }
+
+    /*
+     * Get the sizes of the tags written before and after the encoded audio.
+     * Returns false if the output can't be split this way. Only valid after
+     * render_tag() has been called, with or without a Buffer.
+     */
+    virtual bool tag_sizes(size_t* /*header*/, size_t* /*trailer*/) const {
+        return false;
+    }
+
+    /* Return the factor by which the volume of the audio is scaled. */
+    virtual float volume_scale() const { return 1; }
+
+    /*
+     * Return the offsets in the output at which independently encoded
+     * segments start, followed by the offset at which the last one ends. This
+     * is empty if the output can only be encoded from the beginning. It is
+     * only valid after render_tag() or prepare_segments() has been called.
+     */
+    virtual std::vector<size_t> segment_offsets() const { return {}; }
+
+    /*
+     * Compute the segment offsets without writing anything to the Buffer.
+     * This is used instead of render_tag() by additional Encoders which only
+     * encode segments into a Buffer shared with the Encoder that rendered the
+     * tags. Returns -1 if the output can't be split into segments.
+     */
+    virtual int prepare_segments() { return -1; }
+
+    /*
+     * Start encoding the given segment, discarding any segment in progress.
+     * Sets first_sample to the first input sample needed, at which the
+     * Decoder must be positioned before passing data. The segment is written
+     * to the Buffer once enough data is passed, or encode_finish() is called
+     * at the end of the input.
+     */
+    virtual int start_segment(size_t /*segment*/, uint64_t* /*first_sample*/) {
+        return -1;
+    }
+
+    /* Return whether the segment being encoded has been written out. */
+    virtual bool segment_finished() const { return true; }
+
     // Create and return an Encoder for the specified file type. buffer will
     // not be owned by the class, and dervied classes *must* construct
-    // successfully when buffer is nullptr.
+    // successfully when buffer is nullptr. Such an Encoder is only used to
+    // compute the output size from the tags and stream parameters, so it
+    // should skip setting up the encoding library where possible.
     static std::unique_ptr<Encoder> CreateEncoder(const std::string& file_type,
                                                   Buffer* buffer);
 
@@ -99,8 +156,49 @@ class Decoder {
     virtual time_t mtime() = 0;
     virtual int process_metadata(Encoder* encoder) = 0;
     virtual int process_single_fr(Encoder* encoder) = 0;
+    /*
+     * Position the decoder so the next data passed to the Encoder starts at
+     * the given sample. Returns -1 if this isn't possible.
+     */
+    virtual int seek_sample(uint64_t /*sample*/) { return -1; }
+
+    /*
+     * Return a string which identifies the decoded audio, and doesn't change
+     * when only the tags of the file do, or an empty string if there is
+     * none. It must cover all of the audio, like a hash stored in the file,
+     * since files with the same fingerprint share their encoded audio. A
+     * Decoder which has to read through the file to find it only does so if
+     * 'read_audio' is set. Only valid after process_metadata() has been
+     * called.
+     */
+    virtual std::string audio_fingerprint(bool /*read_audio*/) { return ""; }
+
+    /*
+     * Close the file being decoded and reset all other state, so the Decoder
+     * can open another file as if it were new. Returns false if it can't be
+     * reused.
+     */
+    virtual bool close_file() { return false; }
+
+    /*
+     * Create a Decoder for the given file type, which is a file extension
+     * without the dot, in any case. Returns nullptr if there is none.
+     */
+    static std::unique_ptr<Decoder> CreateDecoder(const char* file_type);
+
+    /*
+     * Return whether there is a Decoder for the given file type, without
+     * creating one.
+     */
+    static bool CanDecode(const char* file_type);
 
-    static std::unique_ptr<Decoder> CreateDecoder(std::string file_type);
+    /*
+     * Give back a Decoder which is no longer needed, to be returned again by
+     * CreateDecoder() for the same type of file. Setting up a Decoder can
+     * take a number of allocations, which are saved this way. Only a few
+     * Decoders of each type are kept.
+     */
+    static void Recycle(std::unique_ptr<Decoder> decoder);
 };
 
 /* Print codec versions. */
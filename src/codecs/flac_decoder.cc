@@ -29,9 +29,12 @@
 
 #include <algorithm>
 #include <cctype>
+#include <cstddef>
 #include <cstdio>
 #include <cstdlib>
+#include <iomanip>
 #include <ostream>
+#include <sstream>
 #include <utility>
 
 #include "codecs/coders.h"
@@ -127,6 +130,54 @@ int FlacDecoder::process_single_fr(Encoder* encoder) {
     return 1;
 }
 
+/*
+ * Seek to the given sample. libFLAC decodes the frame containing the sample
+ * while seeking, passing the data from that sample on to the Encoder.
+ */
+int FlacDecoder::seek_sample(uint64_t sample) {
+    if (!seek_absolute(sample)) {
+        Log(ERROR) << "FLAC seek to sample " << sample << " failed.";
+        flush();
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Finishing returns the libFLAC decoder to the state it had when it was
+ * created, with default settings, which open_file() sets as needed.
+ */
+bool FlacDecoder::close_file() {
+    finish();
+    encoder_c_ = nullptr;
+    mtime_ = 0;
+    info_ = FLAC::Metadata::StreamInfo();
+    has_streaminfo_ = false;
+    return is_valid() && get_state() == FLAC__STREAM_DECODER_UNINITIALIZED;
+}
+
+/*
+ * Use the MD5 sum of the decoded audio in STREAMINFO. It is all zero if the
+ * encoder didn't compute it.
+ */
+std::string FlacDecoder::audio_fingerprint(bool /*read_audio*/) {
+    constexpr size_t kMd5Length = 16;
+    const FLAC__byte* md5 = info_.get_md5sum();
+    if (!has_streaminfo_ ||
+        std::all_of(md5, md5 + kMd5Length,
+                    [](FLAC__byte b) { return b == 0; })) {
+        return "";
+    }
+
+    std::ostringstream fingerprint;
+    fingerprint << "flac-md5:" << std::hex << std::setfill('0');
+    for (size_t i = 0; i < kMd5Length; ++i) {
+        fingerprint << std::setw(2) << static_cast<unsigned int>(md5[i]);
+    }
+    return fingerprint.str();
+}
+
 /*
  * Process metadata information from the FLAC file. This routine does all the
  * heavy lifting of handling FLAC metadata. It uses the set_text_tag() and
@@ -31,6 +31,7 @@
 #include <FLAC/ordinals.h>
 #include <FLAC/stream_decoder.h>
 
+#include <cstdint>
 #include <ctime>
 #include <map>
 #include <string>
@@ -44,6 +45,9 @@ class FlacDecoder : public Decoder, private FLAC::Decoder::File {
     time_t mtime() override;
     int process_metadata(Encoder* encoder) override;
     int process_single_fr(Encoder* encoder) override;
+    int seek_sample(uint64_t sample) override;
+    std::string audio_fingerprint(bool read_audio) override;
+    bool close_file() override;
 
  protected:
     FLAC__StreamDecoderWriteStatus write_callback(
@@ -23,9 +23,14 @@
 #include <id3tag.h>
 #include <lame/lame.h>
 
+#include <algorithm>
 #include <cmath>
 #include <cstdarg>
 #include <cstdlib>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <numeric>
 #include <sstream>
 #include <string>
 #include <utility>
@@ -48,6 +53,16 @@ constexpr int kBufferSlop = 7200;
 
 constexpr int kBitsPerByte = 8;
 
+// Seekable output is split into segments of this many frames, each encoded by
+// a new LAME encoder.
+constexpr size_t kSegmentFrames = 128;
+// Frames encoded and then discarded at the start of each segment after the
+// first, so the encoder has settled by the first frame that is kept.
+constexpr size_t kPrerollFrames = 2;
+
+// Returned by complete_frame_length() for data which is not an MP3 frame.
+constexpr size_t kInvalidFrame = std::numeric_limits<size_t>::max();
+
 /* Callback functions for each type of lame message callback */
 void lame_error(const char* fmt, va_list list) {
     log_with_level(ERROR, "LAME: ", fmt, list);
@@ -59,6 +74,181 @@ void lame_debug(const char* fmt, va_list list) {
     log_with_level(DEBUG, "LAME: ", fmt, list);
 }
 
+/* Set the LAME parameters which don't depend on a particular file. */
+void set_lame_params(lame_t lame_encoder) {
+    if (params.vbr != 0) {
+        lame_set_VBR(lame_encoder, vbr_mt);
+        lame_set_VBR_q(lame_encoder, params.quality);
+        lame_set_VBR_max_bitrate_kbps(lame_encoder, params.bitrate);
+        lame_set_bWriteVbrTag(lame_encoder, 1);
+    } else {
+        lame_set_quality(lame_encoder, params.quality);
+        lame_set_brate(lame_encoder, params.bitrate);
+        lame_set_bWriteVbrTag(lame_encoder, 0);
+        /*
+         * Without the bit reservoir, each frame only holds its own audio, so
+         * separately encoded segments can be joined.
+         */
+        if (params.seekable != 0) {
+            lame_set_disable_reservoir(lame_encoder, 1);
+        }
+    }
+    lame_set_errorf(lame_encoder, &lame_error);
+    lame_set_msgf(lame_encoder, &lame_msg);
+    lame_set_debugf(lame_encoder, &lame_debug);
+}
+
+/*
+ * Initialized LAME encoders for each combination of sample rate and channel
+ * count seen so far. These are never used for encoding. They allow the frame
+ * count and output sample rate to be found, exactly as a real encoder would
+ * compute them, without initializing LAME for every file.
+ */
+std::map<std::pair<int, int>, lame_t> lame_prototypes;
+
+/*
+ * Sizes of the first frames produced by a new LAME encoder for each
+ * combination of sample rate and channel count, enough for one segment
+ * including preroll. In CBR mode these don't depend on the audio, so they
+ * give the size of every segment in advance.
+ */
+std::map<std::pair<int, int>, std::vector<size_t>> segment_frame_sizes;
+
+/* Guards lame_prototypes and segment_frame_sizes. */
+std::mutex lame_prototypes_mutex;
+
+/*
+ * Return the prototype for the given stream parameters, creating it if
+ * necessary. Returns nullptr if LAME does not accept the parameters. Assumes
+ * the prototypes are locked.
+ */
+lame_t get_lame_prototype(int sample_rate, int channels) {
+    const std::pair<int, int> key(sample_rate, channels);
+    auto it = lame_prototypes.find(key);
+    if (it != lame_prototypes.end()) {
+        return it->second;
+    }
+
+    lame_t prototype = lame_init();
+    set_lame_params(prototype);
+    lame_set_in_samplerate(prototype, sample_rate);
+    lame_set_num_channels(prototype, channels);
+    if (lame_init_params(prototype) == -1) {
+        lame_close(prototype);
+        return nullptr;
+    }
+    lame_prototypes.insert(std::make_pair(key, prototype));
+    return prototype;
+}
+
+/*
+ * Return the length of the MPEG audio frame starting at the given offset in
+ * data, if it is complete. Returns 0 if more data is needed, or kInvalidFrame
+ * if there is no valid Layer III frame header at the offset.
+ */
+size_t complete_frame_length(const std::vector<uint8_t>& data, size_t offset) {
+    // Bitrates in kbps by bitrate index, for MPEG-1 and MPEG-2/2.5.
+    static const int kMpeg1Bitrates[] = {0,   32,  40,  48,  56,  64,  80, 96,
+                                         112, 128, 160, 192, 224, 256, 320};
+    static const int kMpeg2Bitrates[] = {0,  8,  16, 24,  32,  40,  48, 56,
+                                         64, 80, 96, 112, 128, 144, 160};
+    static const int kMpeg1SampleRates[] = {44100, 48000, 32000};
+    // Bytes per frame per kbps per Hz, as in calculate_size().
+    const int mpeg1_factor = 144000;
+    const int mpeg2_factor = 72000;
+    const size_t header_length = 4;
+
+    if (data.size() < offset + header_length) {
+        return 0;
+    }
+    // NOLINTBEGIN(readability-magic-numbers)
+    const uint8_t* header = &data[offset];
+    const int version = (header[1] >> 3) & 3;  // 3 = 1, 2 = 2, 0 = 2.5
+    const int layer = (header[1] >> 1) & 3;    // 1 = Layer III
+    const int bitrate_index = header[2] >> 4;
+    const int rate_index = (header[2] >> 2) & 3;
+    const int padding = (header[2] >> 1) & 1;
+    if (header[0] != 0xFF || (header[1] & 0xE0) != 0xE0 || version == 1 ||
+        layer != 1 || bitrate_index == 0 || bitrate_index == 15 ||
+        rate_index == 3) {
+        return kInvalidFrame;
+    }
+
+    int length;
+    if (version == 3) {
+        length = mpeg1_factor * kMpeg1Bitrates[bitrate_index] /
+                 kMpeg1SampleRates[rate_index];
+    } else {
+        // MPEG-2 halves the sample rate and MPEG-2.5 quarters it.
+        length = mpeg2_factor * kMpeg2Bitrates[bitrate_index] /
+                 (kMpeg1SampleRates[rate_index] >> (version == 2 ? 1 : 2));
+    }
+    // NOLINTEND(readability-magic-numbers)
+    const auto frame_length = static_cast<size_t>(length + padding);
+    return data.size() < offset + frame_length ? 0 : frame_length;
+}
+
+/*
+ * Return the frame sizes for segments with the given stream parameters,
+ * finding them if necessary by encoding silence with a new encoder. Returns
+ * nullptr if they cannot be determined. Assumes the prototypes are locked.
+ */
+const std::vector<size_t>* get_segment_frame_sizes(int sample_rate,
+                                                   int channels) {
+    const std::pair<int, int> key(sample_rate, channels);
+    auto it = segment_frame_sizes.find(key);
+    if (it != segment_frame_sizes.end()) {
+        return &it->second;
+    }
+
+    lame_t lame_encoder = lame_init();
+    set_lame_params(lame_encoder);
+    lame_set_in_samplerate(lame_encoder, sample_rate);
+    lame_set_num_channels(lame_encoder, channels);
+    if (lame_init_params(lame_encoder) == -1) {
+        lame_close(lame_encoder);
+        return nullptr;
+    }
+
+    const size_t frames_needed = kPrerollFrames + kSegmentFrames;
+    const int frame_samples = lame_get_framesize(lame_encoder);
+    std::vector<int> silence(static_cast<size_t>(frame_samples));
+    std::vector<uint8_t> data;
+    std::vector<size_t> sizes;
+    size_t offset = 0;
+    // LAME only delays its output by a few frames.
+    for (size_t i = 0; i < 2 * frames_needed && sizes.size() < frames_needed;
+         ++i) {
+        std::vector<uint8_t> vbuffer(5 * silence.size() / 4 +  // NOLINT
+                                     kBufferSlop);
+        int len = lame_encode_buffer_int(lame_encoder, silence.data(),
+                                         silence.data(), frame_samples,
+                                         vbuffer.data(),
+                                         static_cast<int>(vbuffer.size()));
+        if (len < 0) {
+            break;
+        }
+        data.insert(data.end(), vbuffer.begin(), vbuffer.begin() + len);
+
+        size_t length;
+        while (sizes.size() < frames_needed &&
+               (length = complete_frame_length(data, offset)) != 0 &&
+               length != kInvalidFrame) {
+            sizes.push_back(length);
+            offset += length;
+        }
+    }
+    lame_close(lame_encoder);
+
+    if (sizes.size() < frames_needed) {
+        Log(ERROR) << "Unable to determine MP3 frame sizes for seekable "
+                      "output.";
+        return nullptr;
+    }
+    return &segment_frame_sizes.insert(std::make_pair(key, sizes))
+                .first->second;
+}
+
 }  // namespace
 
 /*
@@ -69,26 +259,19 @@ void lame_debug(const char* fmt, va_list list) {
 Mp3Encoder::Mp3Encoder(Buffer* buffer) : buffer_(buffer) {
     id3tag_ = id3_tag_new();
 
+    Mp3Encoder::set_text_tag(METATAG_ENCODER, PACKAGE_NAME);
+
+    /* Without a Buffer, nothing will be encoded, so LAME is not needed. */
+    if (buffer_ == nullptr) {
+        return;
+    }
+
     Log(DEBUG) << "LAME ready to initialize.";
 
     lame_encoder_ = lame_init();
 
-    Mp3Encoder::set_text_tag(METATAG_ENCODER, PACKAGE_NAME);
-
     /* Set lame parameters. */
-    if (params.vbr != 0) {
-        lame_set_VBR(lame_encoder_, vbr_mt);
-        lame_set_VBR_q(lame_encoder_, params.quality);
-        lame_set_VBR_max_bitrate_kbps(lame_encoder_, params.bitrate);
-        lame_set_bWriteVbrTag(lame_encoder_, 1);
-    } else {
-        lame_set_quality(lame_encoder_, params.quality);
-        lame_set_brate(lame_encoder_, params.bitrate);
-        lame_set_bWriteVbrTag(lame_encoder_, 0);
-    }
-    lame_set_errorf(lame_encoder_, &lame_error);
-    lame_set_msgf(lame_encoder_, &lame_msg);
-    lame_set_debugf(lame_encoder_, &lame_debug);
+    set_lame_params(lame_encoder_);
 }
 
 /*
@@ -99,7 +282,9 @@ Mp3Encoder::~Mp3Encoder() {
     if (id3tag_ != nullptr) {
         id3_tag_delete(id3tag_);
     }
-    lame_close(lame_encoder_);
+    if (lame_encoder_ != nullptr) {
+        lame_close(lame_encoder_);
+    }
 }
 
 /*
@@ -109,19 +294,54 @@ Mp3Encoder::~Mp3Encoder() {
  */
 int Mp3Encoder::set_stream_params(uint64_t num_samples, int sample_rate,
                                   int channels) {
-    lame_set_num_samples(lame_encoder_, num_samples);
-    lame_set_in_samplerate(lame_encoder_, sample_rate);
-    lame_set_num_channels(lame_encoder_, channels);
+    num_samples_ = num_samples;
+    sample_rate_ = sample_rate;
+    channels_ = channels;
 
-    Log(DEBUG) << "LAME partially initialized.";
+    if (lame_encoder_ != nullptr) {
+        lame_set_num_samples(lame_encoder_, num_samples);
+        lame_set_in_samplerate(lame_encoder_, sample_rate);
+        lame_set_num_channels(lame_encoder_, channels);
 
-    /* Initialise encoder */
-    if (lame_init_params(lame_encoder_) == -1) {
-        Log(ERROR) << "lame_init_params failed.";
-        return -1;
+        Log(DEBUG) << "LAME partially initialized.";
+
+        /* Initialise encoder */
+        if (lame_init_params(lame_encoder_) == -1) {
+            Log(ERROR) << "lame_init_params failed.";
+            return -1;
+        }
+
+        Log(DEBUG) << "LAME initialized.";
+
+        total_frames_ =
+            static_cast<uint64_t>(lame_get_totalframes(lame_encoder_));
+        out_samplerate_ = lame_get_out_samplerate(lame_encoder_);
+        frame_samples_ = lame_get_framesize(lame_encoder_);
     }
 
-    Log(DEBUG) << "LAME initialized.";
+    std::lock_guard<std::mutex> l(lame_prototypes_mutex);
+    if (lame_encoder_ == nullptr) {
+        lame_t prototype = get_lame_prototype(sample_rate, channels);
+        if (prototype == nullptr) {
+            Log(ERROR) << "lame_init_params failed.";
+            return -1;
+        }
+        lame_set_num_samples(prototype, num_samples);
+        total_frames_ = static_cast<uint64_t>(lame_get_totalframes(prototype));
+        out_samplerate_ = lame_get_out_samplerate(prototype);
+        frame_samples_ = lame_get_framesize(prototype);
+    }
+
+    /*
+     * Seekable output needs every frame to hold exactly frame_samples_ input
+     * samples, which is not the case when resampling. Such files are encoded
+     * in one piece as usual.
+     */
+    if (params.seekable != 0 && params.vbr == 0 &&
+        out_samplerate_ == sample_rate && total_frames_ > 0) {
+        frame_sizes_ = get_segment_frame_sizes(sample_rate, channels);
+        segmented_ = frame_sizes_ != nullptr;
+    }
 
     /*
      * Set the length in the ID3 tag, as this is the most convenient place
@@ -234,17 +454,21 @@ void Mp3Encoder::set_picture_tag(const char* mime_type, int type,
  * http://replaygain.hydrogenaud.io/proposal/player_scale.html
  */
 void Mp3Encoder::set_gain_db(const double dbgain) {
-    Log(DEBUG) << "LAME setting gain to " << dbgain << ".";
     // NOLINTNEXTLINE(readability-magic-numbers)
-    lame_set_scale(lame_encoder_, static_cast<float>(pow(10.0, dbgain / 20)));
+    scale_ = static_cast<float>(pow(10.0, dbgain / 20));
+    // The gain doesn't affect the size, which is all a size-only Encoder needs.
+    if (lame_encoder_ == nullptr) {
+        return;
+    }
+    Log(DEBUG) << "LAME setting gain to " << dbgain << ".";
+    lame_set_scale(lame_encoder_, scale_);
 }
 
 /*
- * Render the ID3 tag into the referenced Buffer. This should be the first
- * thing to go into the Buffer. The ID3v1 tag will also be written 128
- * bytes from the calculated end of the buffer. It has a fixed size.
+ * Fix the size of the ID3v2 tag, and from it the offset of each segment of
+ * seekable output. The tags must not be changed after this is called.
  */
-int Mp3Encoder::render_tag(size_t file_size) {
+int Mp3Encoder::prepare_segments() {
     /*
      * Disable ID3 compression because it hardly saves space and some
      * players don't like it.
@@ -257,8 +481,44 @@ int Mp3Encoder::render_tag(size_t file_size) {
     id3_tag_setlength(id3tag_,
                       id3_tag_render(id3tag_, nullptr) + extra_padding);
 
-    // write v2 tag
     id3size_ = id3_tag_render(id3tag_, nullptr);
+
+    /*
+     * Each segment starts where the previous one ends, with the first right
+     * after the ID3v2 tag. Segments after the first don't include their
+     * preroll frames.
+     */
+    segment_offsets_.clear();
+    if (segmented_) {
+        segment_offsets_.push_back(id3size_);
+        for (uint64_t frame = 0; frame < total_frames_;
+             frame += kSegmentFrames) {
+            const size_t first = frame == 0 ? 0 : kPrerollFrames;
+            const auto count = static_cast<size_t>(std::min<uint64_t>(
+                kSegmentFrames, total_frames_ - frame));
+            auto begin = frame_sizes_->begin() + first;
+            segment_offsets_.push_back(
+                std::accumulate(begin, begin + count, segment_offsets_.back()));
+        }
+    }
+
+    return segmented_ ? 0 : -1;
+}
+
+/*
+ * Render the ID3 tag into the referenced Buffer. This should be the first
+ * thing to go into the Buffer. The ID3v1 tag will also be written 128
+ * bytes from the calculated end of the buffer. It has a fixed size.
+ */
+int Mp3Encoder::render_tag(size_t file_size) {
+    prepare_segments();
+
+    if (buffer_ == nullptr) {
+        // Only the size of the tag is needed.
+        return 0;
+    }
+
+    // write v2 tag
     std::vector<uint8_t> tag24(id3size_);
     id3_tag_render(id3tag_, tag24.data());
     buffer_->write(tag24, true);
@@ -267,15 +527,28 @@ int Mp3Encoder::render_tag(size_t file_size) {
     id3_tag_options(id3tag_, ID3_TAG_OPTION_ID3V1, ~0);
     std::vector<uint8_t> tag1(kId3v1TagLength);
     id3_tag_render(id3tag_, tag1.data());
-    if (file_size == 0) {
+    // The file is only extended to an estimated size at the end, not
+    // truncated, unless sizes are cached.
+    vbr_size_fixed_ = file_size != 0 || params.statcachesize == 0;
+    if (file_size == 0 || segmented_) {
         file_size = calculate_size();
     }
     buffer_->write_end(
         tag1, static_cast<std::ptrdiff_t>(file_size - kId3v1TagLength));
 
+    // Segments are written in place, so the whole file must be addressable.
+    if (segmented_) {
+        buffer_->extend();
+    }
+
     return 0;
 }
 
+void Mp3Encoder::final_range(size_t* offset, size_t* size) const {
+    *offset = id3size_;
+    *size = params.vbr != 0 ? MAX_VBR_FRAME_SIZE : 0;
+}
+
 /*
  * Properly calculate final file size. This is the sum of the size of
  * ID3v2, ID3v1, and raw MP3 data. This is theoretically only approximate
@@ -290,19 +563,25 @@ int Mp3Encoder::render_tag(size_t file_size) {
  *         = frames * 144 * bitrate / samplerate
  * Note that the true bitrate is 1000 times the value stored in params.bitrate,
  * so our conversion factor is actually 144000.
+ *
+ * Seekable output is made of segments of known size, so its size is exact.
  */
 size_t Mp3Encoder::calculate_size() const {
     const int conversion_factor = 144000;
+    if (segmented_) {
+        return segment_offsets_.back() + kId3v1TagLength;
+    }
+    if (out_samplerate_ == 0) {
+        return id3size_ + kId3v1TagLength;
+    }
+
     if (params.vbr != 0) {
         return id3size_ + kId3v1TagLength + MAX_VBR_FRAME_SIZE +
-               static_cast<uint64_t>(lame_get_totalframes(lame_encoder_)) *
-                   conversion_factor * params.bitrate /
-                   lame_get_in_samplerate(lame_encoder_);
+               total_frames_ * conversion_factor * params.bitrate /
+                   sample_rate_;
     }
     return id3size_ + kId3v1TagLength +
-           static_cast<uint64_t>(lame_get_totalframes(lame_encoder_)) *
-               conversion_factor * params.bitrate /
-               lame_get_out_samplerate(lame_encoder_);
+           total_frames_ * conversion_factor * params.bitrate / out_samplerate_;
 }
 
 /*
@@ -347,6 +626,16 @@ int Mp3Encoder::encode_pcm_data(const int32_t* const data[],
     }
     vbuffer.resize(len);
 
+    if (segmented_) {
+        // Anything past the end of the segment is not needed.
+        if (segment_finished_) {
+            return 0;
+        }
+        segment_data_.insert(segment_data_.end(), vbuffer.begin(),
+                             vbuffer.end());
+        return parse_segment(false);
+    }
+
     buffer_->write(vbuffer, false);
 
     return 0;
@@ -358,6 +647,10 @@ int Mp3Encoder::encode_pcm_data(const int32_t* const data[],
  * passed to encode_pcm_data().
  */
 int Mp3Encoder::encode_finish() {
+    if (segmented_ && segment_finished_) {
+        return 0;
+    }
+
     std::vector<uint8_t> vbuffer(kBufferSlop);
 
     int len = lame_encode_flush(lame_encoder_, vbuffer.data(),
@@ -367,6 +660,12 @@ int Mp3Encoder::encode_finish() {
     }
     vbuffer.resize(len);
 
+    if (segmented_) {
+        segment_data_.insert(segment_data_.end(), vbuffer.begin(),
+                             vbuffer.end());
+        return parse_segment(true) == -1 ? -1 : len;
+    }
+
     buffer_->write(vbuffer, params.statcachesize > 0);
     if (params.statcachesize > 0) {
         buffer_->truncate();
@@ -391,6 +690,98 @@ int Mp3Encoder::encode_finish() {
     return len;
 }
 
+/*
+ * Prepare to encode the given segment of seekable output with a new LAME
+ * encoder, so the result doesn't depend on anything encoded before. Segments
+ * after the first start a few frames early, and those frames are dropped.
+ */
+int Mp3Encoder::start_segment(size_t segment, uint64_t* first_sample) {
+    if (!segmented_ || segment + 1 >= segment_offsets_.size()) {
+        return -1;
+    }
+
+    segment_ = segment;
+    preroll_frames_ = segment == 0 ? 0 : kPrerollFrames;
+    *first_sample = (segment * kSegmentFrames - preroll_frames_) *
+                    static_cast<uint64_t>(frame_samples_);
+    segment_data_.clear();
+    parse_offset_ = 0;
+    kept_offset_ = 0;
+    segment_frames_ = 0;
+    segment_finished_ = false;
+
+    lame_close(lame_encoder_);
+    lame_encoder_ = lame_init();
+    set_lame_params(lame_encoder_);
+    lame_set_scale(lame_encoder_, scale_);
+    lame_set_num_samples(lame_encoder_, num_samples_ - *first_sample);
+    lame_set_in_samplerate(lame_encoder_, sample_rate_);
+    lame_set_num_channels(lame_encoder_, channels_);
+    if (lame_init_params(lame_encoder_) == -1) {
+        Log(ERROR) << "lame_init_params failed.";
+        return -1;
+    }
+
+    Log(DEBUG) << "LAME initialized for segment " << segment << ".";
+    return 0;
+}
+
+/*
+ * Find the complete frames output so far for the current segment. Once all
+ * its frames are available, or at the end of the input, the segment is
+ * written to the Buffer.
+ */
+int Mp3Encoder::parse_segment(bool at_end) {
+    const size_t frames_needed = preroll_frames_ + kSegmentFrames;
+    while (segment_frames_ < frames_needed) {
+        size_t length = complete_frame_length(segment_data_, parse_offset_);
+        if (length == kInvalidFrame) {
+            Log(ERROR) << "Invalid MP3 frame in segment " << segment_ << ".";
+            return -1;
+        }
+        if (length == 0) {
+            break;
+        }
+        if (segment_frames_ == preroll_frames_) {
+            kept_offset_ = parse_offset_;
+        }
+        parse_offset_ += length;
+        ++segment_frames_;
+    }
+
+    if (at_end || segment_frames_ == frames_needed) {
+        return finish_segment();
+    }
+    return 0;
+}
+
+/*
+ * Write the frames of the current segment which are kept into their place in
+ * the Buffer. The size should always match the calibrated frame sizes. If it
+ * doesn't, the frames can't be put in place without corrupting them, so
+ * nothing is written and -1 is returned.
+ */
+int Mp3Encoder::finish_segment() {
+    if (segment_frames_ <= preroll_frames_) {
+        kept_offset_ = parse_offset_;
+    }
+
+    const size_t offset = segment_offsets_[segment_];
+    const size_t size = segment_offsets_[segment_ + 1] - offset;
+    std::vector<uint8_t> data(segment_data_.begin() + kept_offset_,
+                              segment_data_.begin() + parse_offset_);
+    if (data.size() != size) {
+        Log(ERROR) << "Segment " << segment_ << " is " << data.size()
+                   << " bytes, expected " << size << ".";
+        return -1;
+    }
+    buffer_->write_to(data, static_cast<std::ptrdiff_t>(offset));
+
+    segment_data_.clear();
+    segment_finished_ = true;
+    return 0;
+}
+
 /*
  * This map contains the association from the standard values in the enum in
  * coders.h to ID3 values.
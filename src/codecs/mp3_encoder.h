@@ -26,6 +26,7 @@
 #include <cstddef>
 #include <cstdint>
 #include <map>
+#include <vector>
 
 #include "codecs/coders.h"
 #include "mp3fs.h"
@@ -52,18 +53,70 @@ class Mp3Encoder : public Encoder {
                         unsigned int sample_size) override;
     int encode_finish() override;
 
+    /*
+     * VBR output is read as it is encoded, except for the Xing data, as long
+     * as the size of the file is fixed. It isn't when the size is only
+     * estimated and the output is truncated to its real size at the end.
+     */
+    bool no_partial_encode() override {
+        return params.vbr != 0 && !vbr_size_fixed_;
+    }
+
     /*
      * The Xing data (which is pretty close to the beginning of the
-     * file) cannot be determined until the entire file is encoded, so
-     * transcode the entire file for any read.
+     * file) cannot be determined until the entire file is encoded.
      */
-    bool no_partial_encode() override { return params.vbr != 0; }
+    void final_range(size_t* offset, size_t* size) const override;
+
+    bool tag_sizes(size_t* header, size_t* trailer) const override {
+        *header = id3size_;
+        *trailer = kId3v1TagLength;
+        return true;
+    }
+    float volume_scale() const override { return scale_; }
+
+    std::vector<size_t> segment_offsets() const override {
+        return segment_offsets_;
+    }
+    int prepare_segments() override;
+    int start_segment(size_t segment, uint64_t* first_sample) override;
+    bool segment_finished() const override { return segment_finished_; }
 
  private:
-    lame_t lame_encoder_;
+    int parse_segment(bool at_end);
+    int finish_segment();
+
+    // This is null when there is no Buffer, since only the size is needed.
+    lame_t lame_encoder_ = nullptr;
     struct id3_tag* id3tag_;
     size_t id3size_ = 0;
+    // Whether the output size given to render_tag() is the final one.
+    bool vbr_size_fixed_ = false;
     Buffer* buffer_;
+    uint64_t num_samples_ = 0;
+    int sample_rate_ = 0;
+    int channels_ = 0;
+    uint64_t total_frames_ = 0;
+    int out_samplerate_ = 0;
+    int frame_samples_ = 0;
+    float scale_ = 1;
+
+    /*
+     * State for seekable output, which is split into segments that are
+     * encoded separately. frame_sizes_ holds the size of each frame produced
+     * by a new LAME encoder, which is the same for every file with the same
+     * stream parameters.
+     */
+    bool segmented_ = false;
+    const std::vector<size_t>* frame_sizes_ = nullptr;
+    std::vector<size_t> segment_offsets_;
+    size_t segment_ = 0;
+    size_t preroll_frames_ = 0;
+    std::vector<uint8_t> segment_data_;
+    size_t parse_offset_ = 0;
+    size_t kept_offset_ = 0;
+    size_t segment_frames_ = 0;
+    bool segment_finished_ = true;
     using meta_map_t = std::map<int, const char*>;
     static const meta_map_t kMetatagMap;
 };
@@ -20,7 +20,9 @@
 
 #include "codecs/vorbis_decoder.h"
 
+#include <ogg/ogg.h>
 #include <sys/stat.h>
+#include <unistd.h>
 #include <vorbis/codec.h>
 #include <vorbis/vorbisfile.h>
 
@@ -29,14 +31,26 @@
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <iomanip>
 #include <ostream>
+#include <sstream>
 #include <utility>
 #include <vector>
 
 #include "codecs/picture.h"
+#include "hash.h"
 #include "lib/base64.h"
 #include "logging.h"
 
+namespace {
+
+// Starts a second FNV-1a hash, independent of the first.
+constexpr uint64_t kCheckBasis = 0x6d703366766f7262ULL;
+// Bytes of the file read at a time when hashing its packets.
+constexpr long kHashReadSize = 64 * 1024;
+
+}  // namespace
+
 /* Free the OggVorbis_File data structure and close the open Ogg Vorbis file
  * after the decoding process has finished.
  */
@@ -240,6 +254,143 @@ int VorbisDecoder::process_single_fr(Encoder* encoder) {
     return -1;
 }
 
+/* Seek to the given sample, so the next call to ov_read starts there. */
+int VorbisDecoder::seek_sample(uint64_t sample) {
+    if (ov_pcm_seek(&vf_, static_cast<ogg_int64_t>(sample)) != 0) {
+        Log(ERROR) << "Ogg Vorbis decoder: Seek to sample " << sample
+                   << " failed.";
+        return -1;
+    }
+
+    return 0;
+}
+
+/* ov_clear() closes the file and zeroes vf_, ready for ov_open(). */
+bool VorbisDecoder::close_file() {
+    ov_clear(&vf_);
+    mtime_ = 0;
+    vi_ = nullptr;
+    current_section_ = 0;
+    return true;
+}
+
+/*
+ * Ogg Vorbis files have no hash of their audio, so hash the packets of the
+ * stream as they are stored, without decoding them. The tags are in the
+ * comment header, the second packet, which is left out. The pages holding
+ * the packets are not hashed, since changing the tags can move them. Two
+ * independent hashes are combined so that files with different audio don't
+ * share a fingerprint.
+ */
+std::string VorbisDecoder::audio_fingerprint(bool read_audio) {
+    if (!read_audio || vi_ == nullptr) {
+        return "";
+    }
+
+    uint64_t hash = kFnvOffsetBasis;
+    uint64_t check = kCheckBasis;
+    if (!hash_packets(&hash, &check)) {
+        Log(ERROR) << "Ogg Vorbis decoder: Failed to fingerprint audio.";
+        return "";
+    }
+
+    constexpr int kHashHexDigits = 16;
+    std::ostringstream fingerprint;
+    fingerprint << "vorbis:" << std::hex << std::setfill('0')
+                << std::setw(kHashHexDigits) << hash
+                << std::setw(kHashHexDigits) << check;
+    return fingerprint.str();
+}
+
+/*
+ * Hash the size and contents of each packet of the Vorbis stream, apart from
+ * the comment headers, and the granule position which ends each link of a
+ * chained stream. The file is read with pread(), so the position of the
+ * decoder in it doesn't change. Pages of other streams grouped with it are
+ * skipped. Returns false if the file can't be read or is damaged.
+ */
+bool VorbisDecoder::hash_packets(uint64_t* hash, uint64_t* check) {
+    const int fd = fileno(static_cast<FILE*>(vf_.datasource));
+    ogg_sync_state sync;
+    ogg_sync_init(&sync);
+    ogg_stream_state stream;
+    bool stream_open = false;
+    bool in_link = false;
+    int serial = 0;
+    ogg_int64_t packets = 0;
+    ogg_int64_t granulepos = 0;
+    bool ok = true;
+
+    auto add = [hash, check](const void* data, size_t size) {
+        *hash = fnv1a_64(data, size, *hash);
+        *check = fnv1a_64(data, size, *check);
+    };
+
+    off_t offset = 0;
+    while (ok) {
+        char* data = ogg_sync_buffer(&sync, kHashReadSize);
+        const ssize_t read_bytes =
+            data != nullptr ? pread(fd, data, kHashReadSize, offset) : -1;
+        if (read_bytes <= 0) {
+            ok = read_bytes == 0;
+            break;
+        }
+        ogg_sync_wrote(&sync, static_cast<long>(read_bytes));
+        offset += read_bytes;
+
+        ogg_page page;
+        while (ok && ogg_sync_pageout(&sync, &page) == 1) {
+            // A new stream after the end of the last one is the next link.
+            if (ogg_page_bos(&page) != 0 && !in_link) {
+                if (stream_open) {
+                    ogg_stream_clear(&stream);
+                }
+                serial = ogg_page_serialno(&page);
+                ogg_stream_init(&stream, serial);
+                stream_open = true;
+                in_link = true;
+                packets = 0;
+            }
+            if (!in_link || ogg_page_serialno(&page) != serial ||
+                ogg_stream_pagein(&stream, &page) != 0) {
+                continue;
+            }
+
+            ogg_packet packet;
+            int ret = 0;
+            while ((ret = ogg_stream_packetout(&stream, &packet)) != 0) {
+                if (ret < 0) {
+                    // Data is missing between two pages.
+                    ok = false;
+                    break;
+                }
+                if (packets++ != 1) {
+                    const auto size = static_cast<uint64_t>(packet.bytes);
+                    add(&size, sizeof(size));
+                    add(packet.packet, static_cast<size_t>(packet.bytes));
+                }
+                if (packet.granulepos != -1) {
+                    granulepos = packet.granulepos;
+                }
+                if (packet.e_o_s != 0) {
+                    add(&granulepos, sizeof(granulepos));
+                    in_link = false;
+                }
+            }
+        }
+    }
+
+    if (in_link) {
+        // The last link has no end of stream packet.
+        add(&granulepos, sizeof(granulepos));
+    }
+    if (stream_open) {
+        ogg_stream_clear(&stream);
+    }
+    ogg_sync_clear(&sync);
+    return ok && packets > 3;
+}
+
 const VorbisDecoder::meta_map_t VorbisDecoder::kMetatagMap = {
     {"TITLE", METATAG_TITLE},
     {"ARTIST", METATAG_ARTIST},
@@ -24,6 +24,7 @@
 #include <vorbis/codec.h>
 #include <vorbis/vorbisfile.h>
 
+#include <cstdint>
 #include <ctime>
 #include <map>
 #include <string>
@@ -37,12 +38,17 @@ class VorbisDecoder : public Decoder {
     time_t mtime() override;
     int process_metadata(Encoder* encoder) override;
     int process_single_fr(Encoder* encoder) override;
+    int seek_sample(uint64_t sample) override;
+    std::string audio_fingerprint(bool read_audio) override;
+    bool close_file() override;
 
  private:
-    time_t mtime_;
-    OggVorbis_File vf_;
-    vorbis_info* vi_;
-    int current_section_;
+    time_t mtime_ = 0;
+    OggVorbis_File vf_ = {};
+    vorbis_info* vi_ = nullptr;
+    int current_section_ = 0;
+
+    bool hash_packets(uint64_t* hash, uint64_t* check);
     using meta_map_t = std::map<std::string, int>;
     static const meta_map_t kMetatagMap;
 };
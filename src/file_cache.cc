@@ -0,0 +1,408 @@
+/*
+ * Transcoded file cache source for mp3fs
+ *
+ * Copyright (C) 2021 K. Henriksson
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include "file_cache.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <memory>
+#include <ostream>
+#include <sstream>
+#include <utility>
+#include <vector>
+
+#include "buffer.h"
+#include "hash.h"
+#include "logging.h"
+#include "mp3fs.h"
+
+namespace {
+
+constexpr size_t kBytesPerMegabyte = 1024 * 1024;
+constexpr size_t kCopySize = 64 * 1024;
+constexpr int kHashHexDigits = 16;
+constexpr size_t kEntryNameLength = 2 * kHashHexDigits;
+const char kTempPrefix[] = "tmp.";
+const char kKeySuffix[] = ".key";
+
+/* Write all of data to fd, retrying on short writes. */
+bool write_all(int fd, const uint8_t* data, size_t size) {
+    while (size > 0) {
+        ssize_t written = write(fd, data, size);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += written;
+        size -= written;
+    }
+    return true;
+}
+
+/* Read the whole file at 'path' into 'data'. */
+bool read_file(const std::string& path, std::string* data) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+        return false;
+    }
+
+    char chunk[4096];
+    ssize_t count;
+    data->clear();
+    while ((count = read(fd, chunk, sizeof(chunk))) != 0) {
+        if (count == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            close(fd);
+            return false;
+        }
+        data->append(chunk, static_cast<size_t>(count));
+    }
+    close(fd);
+    return true;
+}
+
+/* Create a temporary file in the cache, setting 'path' to its name. */
+int make_temp(std::string* path) {
+    *path = std::string(params.cachedir) + "/" + kTempPrefix + "XXXXXX";
+    return mkstemp(&(*path)[0]);
+}
+
+bool is_entry_name(const std::string& name) {
+    return name.size() == kEntryNameLength &&
+           std::all_of(name.begin(), name.end(), [](char c) {
+               return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f');
+           });
+}
+
+}  // namespace
+
+/*
+ * Open the cached output for the given source file, using 'mtime' as the
+ * modified time of the source file. The entry is marked as recently used.
+ */
+int FileCache::open_entry(const std::string& filename, time_t mtime) {
+    if (!enabled()) {
+        return -1;
+    }
+
+    int fd = open_keyed(entry_key(filename, mtime));
+    if (fd != -1) {
+        Log(DEBUG) << "Found file '" << filename << "' in transcode cache";
+    }
+    return fd;
+}
+
+bool FileCache::get_size(const std::string& filename, time_t mtime,
+                         size_t* size) {
+    return enabled() && get_keyed_size(entry_key(filename, mtime), size);
+}
+
+void FileCache::put_entry(const std::string& filename, time_t mtime,
+                          const Buffer& buffer) {
+    if (!enabled()) {
+        return;
+    }
+
+    const std::string key = entry_key(filename, mtime);
+    if (put_keyed(key, buffer, 0, buffer.size())) {
+        Log(DEBUG) << "Added file '" << filename << "' to transcode cache as "
+                   << hash_name(key);
+    }
+}
+
+int FileCache::open_audio(const std::string& key) {
+    if (!enabled()) {
+        return -1;
+    }
+    return open_keyed(audio_entry_key(key));
+}
+
+bool FileCache::get_audio_size(const std::string& key, size_t* size) {
+    return enabled() && get_keyed_size(audio_entry_key(key), size);
+}
+
+void FileCache::put_audio(const std::string& key, const Buffer& buffer,
+                          size_t start, size_t end) {
+    if (!enabled()) {
+        return;
+    }
+    put_keyed(audio_entry_key(key), buffer, start, end);
+}
+
+/*
+ * Open the entry with the given key and mark it as recently used. The entry
+ * is only opened if the key stored with it matches.
+ */
+int FileCache::open_keyed(const std::string& key) {
+    const std::string name = hash_name(key);
+    if (!has_key(name, key)) {
+        errno = 0;
+        return -1;
+    }
+
+    int fd = open(entry_path(name).c_str(), O_RDONLY);
+    if (fd == -1) {
+        errno = 0;
+        return -1;
+    }
+
+    struct stat s = {};
+    if (fstat(fd, &s) == -1) {
+        close(fd);
+        errno = 0;
+        return -1;
+    }
+
+    // Record the access time in the file itself so the LRU order survives
+    // restarts, regardless of how the cache filesystem handles atime.
+    const struct timespec times[2] = {{0, UTIME_OMIT}, {0, UTIME_NOW}};
+    futimens(fd, times);
+
+    std::lock_guard<std::mutex> l(mutex_);
+    touch_entry(name, static_cast<size_t>(s.st_size));
+    return fd;
+}
+
+bool FileCache::get_keyed_size(const std::string& key, size_t* size) {
+    const std::string name = hash_name(key);
+    struct stat s = {};
+    if (!has_key(name, key) || stat(entry_path(name).c_str(), &s) == -1) {
+        errno = 0;
+        return false;
+    }
+
+    *size = static_cast<size_t>(s.st_size);
+    return true;
+}
+
+/*
+ * Store the given range of the Buffer as the entry with the given key. The
+ * key and the entry are each written to a temporary file and renamed into
+ * place. Returns whether it was stored.
+ */
+bool FileCache::put_keyed(const std::string& key, const Buffer& buffer,
+                          size_t start, size_t end) {
+    const size_t size = buffer.size();
+    if (size == 0 || !buffer.valid_bytes(0, size) || start > end ||
+        end > size) {
+        Log(ERROR) << "Not storing incomplete output in transcode cache";
+        return false;
+    }
+
+    const std::string name = hash_name(key);
+    std::string temp_path;
+    int fd = make_temp(&temp_path);
+    if (fd == -1) {
+        Log(ERROR) << "Failed to create file in transcode cache: "
+                   << strerror(errno);
+        errno = 0;
+        return false;
+    }
+
+    bool ok = write_all(fd, reinterpret_cast<const uint8_t*>(key.data()),
+                        key.size());
+    ok = close(fd) == 0 && ok;
+    if (!ok || rename(temp_path.c_str(), key_path(name).c_str()) == -1) {
+        Log(ERROR) << "Failed to write key to transcode cache: "
+                   << strerror(errno);
+        unlink(temp_path.c_str());
+        errno = 0;
+        return false;
+    }
+
+    fd = make_temp(&temp_path);
+    if (fd == -1) {
+        Log(ERROR) << "Failed to create file in transcode cache: "
+                   << strerror(errno);
+        errno = 0;
+        return false;
+    }
+
+    std::vector<uint8_t> data;
+    for (size_t offset = start; ok && offset < end; offset += data.size()) {
+        data.resize(std::min(kCopySize, end - offset));
+        buffer.copy_into(data.data(), static_cast<std::ptrdiff_t>(offset),
+                         data.size());
+        ok = write_all(fd, data.data(), data.size());
+    }
+    ok = close(fd) == 0 && ok;
+
+    if (!ok || rename(temp_path.c_str(), entry_path(name).c_str()) == -1) {
+        Log(ERROR) << "Failed to write file to transcode cache: "
+                   << strerror(errno);
+        unlink(temp_path.c_str());
+        errno = 0;
+        return false;
+    }
+
+    std::lock_guard<std::mutex> l(mutex_);
+    touch_entry(name, end - start);
+    if (params.cachesize > 0 &&
+        total_size_ > params.cachesize * kBytesPerMegabyte) {
+        prune();
+    }
+    return true;
+}
+
+bool FileCache::enabled() {
+    return params.cachedir != nullptr && params.cachedir[0] != '\0';
+}
+
+/*
+ * Compute the key of the cache entry for the given source file, made of
+ * everything which determines the contents of the output file.
+ */
+std::string FileCache::entry_key(const std::string& filename, time_t mtime) {
+    std::ostringstream key;
+    key << filename << '\0' << mtime << '\0' << encoding_params_key();
+    return key.str();
+}
+
+/* The key is kept apart from those of whole output files. */
+std::string FileCache::audio_entry_key(const std::string& key) {
+    return std::string("audio") + '\0' + key;
+}
+
+std::string FileCache::hash_name(const std::string& key) {
+    const uint64_t hash = fnv1a_64(key);
+    std::ostringstream name;
+    name << std::hex << std::setfill('0') << std::setw(kHashHexDigits) << hash
+         << std::setw(kHashHexDigits) << fnv1a_64(key, hash);
+    return name.str();
+}
+
+std::string FileCache::entry_path(const std::string& name) {
+    return std::string(params.cachedir) + "/" + name;
+}
+
+std::string FileCache::key_path(const std::string& name) {
+    return entry_path(name) + kKeySuffix;
+}
+
+/* Return whether the entry with the given name was stored for 'key'. */
+bool FileCache::has_key(const std::string& name, const std::string& key) {
+    std::string stored;
+    return read_file(key_path(name), &stored) && stored == key;
+}
+
+/*
+ * Read the existing entries in the cache directory, using the modified time of
+ * each file as its last access time. Temporary files left behind by an
+ * interrupted write are removed. Assumes the cache is locked.
+ */
+void FileCache::load_entries() {
+    loaded_ = true;
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wignored-attributes"
+    std::unique_ptr<DIR, decltype(&closedir)> dp(opendir(params.cachedir),
+                                                 closedir);
+#pragma GCC diagnostic pop
+    if (!dp) {
+        Log(ERROR) << "Failed to open transcode cache directory: "
+                   << strerror(errno);
+        errno = 0;
+        return;
+    }
+
+    while (struct dirent* de = readdir(dp.get())) {
+        const std::string name = de->d_name;
+        if (name.compare(0, strlen(kTempPrefix), kTempPrefix) == 0) {
+            unlink(entry_path(name).c_str());
+            continue;
+        }
+
+        struct stat s = {};
+        if (!is_entry_name(name) || entries_.count(name) != 0 ||
+            stat(entry_path(name).c_str(), &s) == -1 || !S_ISREG(s.st_mode)) {
+            continue;
+        }
+        entries_.insert(std::make_pair(
+            name, Entry {static_cast<size_t>(s.st_size), s.st_mtime}));
+        total_size_ += static_cast<size_t>(s.st_size);
+    }
+    errno = 0;
+
+    Log(DEBUG) << "Loaded " << entries_.size() << " transcode cache entries, "
+               << total_size_ << " bytes";
+}
+
+/*
+ * Add or update an entry, marking it as most recently used. Assumes the cache
+ * is locked.
+ */
+void FileCache::touch_entry(const std::string& name, size_t size) {
+    if (!loaded_) {
+        load_entries();
+    }
+
+    auto it = entries_.find(name);
+    if (it != entries_.end()) {
+        total_size_ -= it->second.size;
+        entries_.erase(it);
+    }
+    entries_.insert(std::make_pair(name, Entry {size, time(nullptr)}));
+    total_size_ += size;
+}
+
+/*
+ * Remove the least recently used entries until the cache is at 90% of its
+ * maximum size. Open file descriptors for removed entries remain valid.
+ * Assumes the cache is locked.
+ */
+void FileCache::prune() {
+    Log(DEBUG) << "Pruning transcode cache";
+    const size_t target_size =
+        9 * params.cachesize * kBytesPerMegabyte / 10;  // 90% NOLINT
+
+    using cache_entry_t = std::pair<std::string, Entry>;
+    std::vector<cache_entry_t> sorted_entries(entries_.begin(),
+                                              entries_.end());
+    std::sort(sorted_entries.begin(), sorted_entries.end(),
+              [](const cache_entry_t& a, const cache_entry_t& b) {
+                  return a.second.atime < b.second.atime;
+              });
+
+    for (const auto& e : sorted_entries) {
+        if (total_size_ <= target_size) {
+            break;
+        }
+        Log(DEBUG) << "Pruned oldest entry " << e.first
+                   << " from transcode cache";
+        unlink(entry_path(e.first).c_str());
+        unlink(key_path(e.first).c_str());
+        entries_.erase(e.first);
+        total_size_ -= e.second.size;
+    }
+    errno = 0;
+}
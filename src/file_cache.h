@@ -0,0 +1,120 @@
+/*
+ * Transcoded file cache interface for mp3fs
+ *
+ * Copyright (C) 2021 K. Henriksson
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef MP3FS_FILE_CACHE_H_
+#define MP3FS_FILE_CACHE_H_
+
+#include <cstddef>
+#include <ctime>
+#include <map>
+#include <mutex>
+#include <string>
+
+class Buffer;
+
+/*
+ * Cache of finished output files, stored in the directory given by the
+ * cachedir option. Entries are keyed by source file name, source modified
+ * time, and encoding parameters. When the total size of the cache exceeds
+ * the cachesize option, the least recently used entries are removed.
+ *
+ * Entries are named by a hash of their key, and the key itself is stored
+ * next to each entry and compared before the entry is used, so a collision
+ * of the hashes can't serve the wrong file.
+ *
+ * The encoded audio without the tags is stored as well, keyed by what
+ * determines it, so output whose source only had its tags changed can be
+ * put together again without encoding.
+ */
+class FileCache {
+ public:
+    FileCache() = default;
+    ~FileCache() = default;
+    FileCache(const FileCache&) = delete;
+    FileCache& operator=(const FileCache&) = delete;
+
+    /*
+     * Open the cached output for the given source file. Returns a read-only
+     * file descriptor owned by the caller, or -1 if there is no entry.
+     */
+    int open_entry(const std::string& filename, time_t mtime);
+
+    /* Get the size of the cached output for the given source file. */
+    bool get_size(const std::string& filename, time_t mtime, size_t* size);
+
+    /*
+     * Store the finished output in the given Buffer. The entry is written to
+     * a temporary file and renamed into place, so readers never see a
+     * partially written entry.
+     */
+    void put_entry(const std::string& filename, time_t mtime,
+                   const Buffer& buffer);
+
+    /*
+     * Open the cached audio with the given key, which must identify the
+     * decoded audio and everything else which affects its encoding. Returns
+     * a read-only file descriptor owned by the caller, or -1 if there is no
+     * entry.
+     */
+    int open_audio(const std::string& key);
+
+    /* Get the size of the cached audio with the given key. */
+    bool get_audio_size(const std::string& key, size_t* size);
+
+    /*
+     * Store the audio in the given range of the finished output in the given
+     * Buffer.
+     */
+    void put_audio(const std::string& key, const Buffer& buffer, size_t start,
+                   size_t end);
+
+    /* Return whether the cache is in use. */
+    static bool enabled();
+
+ private:
+    /* Holds the size and last access time of a cache entry. */
+    struct Entry {
+        size_t size;
+        time_t atime;
+    };
+
+    static std::string entry_key(const std::string& filename, time_t mtime);
+    static std::string audio_entry_key(const std::string& key);
+    static std::string hash_name(const std::string& key);
+    static std::string entry_path(const std::string& name);
+    static std::string key_path(const std::string& name);
+    static bool has_key(const std::string& name, const std::string& key);
+
+    int open_keyed(const std::string& key);
+    bool get_keyed_size(const std::string& key, size_t* size);
+    bool put_keyed(const std::string& key, const Buffer& buffer, size_t start,
+                   size_t end);
+
+    void load_entries();
+    void touch_entry(const std::string& name, size_t size);
+    void prune();
+
+    std::map<std::string, Entry> entries_;
+    size_t total_size_ = 0;
+    bool loaded_ = false;
+    std::mutex mutex_;
+};
+
+#endif  // MP3FS_FILE_CACHE_H_
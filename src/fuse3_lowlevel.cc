@@ -0,0 +1,616 @@
+/*
+ * FUSE 3 low-level filesystem source for mp3fs
+ *
+ * Copyright (C) 2021 K. Henriksson
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#define FUSE_USE_VERSION 32
+
+#include <fuse_lowlevel.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/uio.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <initializer_list>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "logging.h"
+#include "mp3fs.h"
+#include "operations.h"
+#include "reader.h"
+#include "source_watcher.h"
+
+namespace {
+
+/*
+ * How long the kernel may cache names and attributes when the source
+ * directory is watched, in seconds. The kernel is told about changes as they
+ * happen, so it only needs to check back occasionally.
+ */
+constexpr double kWatchedTimeout = 3600.0;
+
+/*
+ * The kernel refers to files by inode number, while mp3fs works with paths.
+ * Each path the kernel looks up gets a number which stays valid until the
+ * kernel forgets it. Numbers are never reused, so generations aren't needed.
+ * A path which is moved away or removed is detached from its number, so it
+ * gets a new number if it is used again.
+ */
+class InodeTable {
+ public:
+    /* Return the number for 'path', counting one more kernel reference. */
+    fuse_ino_t lookup(const std::string& path) {
+        std::lock_guard<std::mutex> l(mutex_);
+        auto it = numbers_.find(path);
+        fuse_ino_t ino = 0;
+        if (it == numbers_.end()) {
+            ino = next_ino_++;
+            numbers_.insert(std::make_pair(path, ino));
+            inodes_.insert(std::make_pair(ino, Inode {path, 0}));
+        } else {
+            ino = it->second;
+        }
+        ++inodes_[ino].nlookup;
+        return ino;
+    }
+
+    /* Drop 'nlookup' kernel references to 'ino'. */
+    void forget(fuse_ino_t ino, uint64_t nlookup) {
+        std::lock_guard<std::mutex> l(mutex_);
+        auto it = inodes_.find(ino);
+        if (it == inodes_.end()) {
+            return;
+        }
+        if (it->second.nlookup > nlookup) {
+            it->second.nlookup -= nlookup;
+            return;
+        }
+        auto number = numbers_.find(it->second.path);
+        if (number != numbers_.end() && number->second == ino) {
+            numbers_.erase(number);
+        }
+        inodes_.erase(it);
+    }
+
+    /*
+     * Stop giving out the numbers of 'path' and everything below it. The
+     * kernel can still use numbers it has until it forgets them.
+     */
+    void detach(const std::string& path) {
+        std::lock_guard<std::mutex> l(mutex_);
+        numbers_.erase(path);
+        const std::string prefix = path + "/";
+        auto it = numbers_.lower_bound(prefix);
+        while (it != numbers_.end() &&
+               it->first.compare(0, prefix.size(), prefix) == 0) {
+            it = numbers_.erase(it);
+        }
+    }
+
+    /*
+     * Find the number for 'path' without adding a reference. Returns false if
+     * the kernel doesn't know the path.
+     */
+    bool find(const std::string& path, fuse_ino_t* ino) {
+        if (path == "/") {
+            *ino = FUSE_ROOT_ID;
+            return true;
+        }
+
+        std::lock_guard<std::mutex> l(mutex_);
+        auto it = numbers_.find(path);
+        if (it == numbers_.end()) {
+            return false;
+        }
+        *ino = it->second;
+        return true;
+    }
+
+    /* Find the path for 'ino'. Returns false if the number is unknown. */
+    bool path(fuse_ino_t ino, std::string* path) {
+        if (ino == FUSE_ROOT_ID) {
+            *path = "/";
+            return true;
+        }
+
+        std::lock_guard<std::mutex> l(mutex_);
+        auto it = inodes_.find(ino);
+        if (it == inodes_.end()) {
+            return false;
+        }
+        *path = it->second.path;
+        return true;
+    }
+
+ private:
+    struct Inode {
+        std::string path;
+        uint64_t nlookup;
+    };
+
+    std::mutex mutex_;
+    std::unordered_map<fuse_ino_t, Inode> inodes_;
+    // Ordered, so the paths below a directory can be found.
+    std::map<std::string, fuse_ino_t> numbers_;
+    fuse_ino_t next_ino_ = FUSE_ROOT_ID + 1;
+};
+
+InodeTable inode_table;
+
+struct fuse_session* session = nullptr;
+struct fuse_conn_info_opts* conn_opts = nullptr;
+bool watching = false;
+
+double cache_timeout() {
+    return watching ? kWatchedTimeout : params.attrtimeout;
+}
+
+/* An open directory, with its path for looking up entries in readdirplus. */
+struct DirHandle {
+    std::string path;
+    std::unique_ptr<DirLister> lister;
+};
+
+std::string child_path(const std::string& parent, const char* name) {
+    return parent == "/" ? parent + name : parent + "/" + name;
+}
+
+bool is_dot_or_dotdot(const std::string& name) {
+    return name == "." || name == "..";
+}
+
+/* Look up the path for 'ino', replying with an error if it is unknown. */
+bool inode_path(fuse_req_t req, fuse_ino_t ino, std::string* path) {
+    if (!inode_table.path(ino, path)) {
+        Log(ERROR) << "Request for unknown inode " << ino;
+        fuse_reply_err(req, ESTALE);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Fill in attributes and a new inode number for 'path'. The kernel holds a
+ * reference to the inode once the entry is sent.
+ */
+int make_entry(const std::string& path, struct fuse_entry_param* e) {
+    *e = {};
+    int ret = mp3fs_getattr(path.c_str(), &e->attr);
+    if (ret != 0) {
+        return ret;
+    }
+
+    e->ino = inode_table.lookup(path);
+    e->attr.st_ino = e->ino;
+    e->attr_timeout = cache_timeout();
+    e->entry_timeout = cache_timeout();
+    return 0;
+}
+
+/*
+ * Tell the kernel to drop what it has cached for a changed source entry:
+ * the attributes of its directory, and the name and the attributes and data
+ * of the entry itself under both its source and output names. An entry which
+ * is gone no longer keeps its inode numbers.
+ */
+void notify_source_change(const std::string& dir, const std::string& name,
+                          bool gone) {
+    fuse_ino_t ino = 0;
+    if (!inode_table.find(dir, &ino)) {
+        return;
+    }
+    fuse_lowlevel_notify_inval_inode(session, ino, 0, 0);
+    if (name.empty()) {
+        return;
+    }
+
+    const std::string output_name = convert_extension(name);
+    for (const std::string& entry_name : {name, output_name}) {
+        fuse_lowlevel_notify_inval_entry(session, ino, entry_name.c_str(),
+                                         entry_name.size());
+        const std::string entry_path = child_path(dir, entry_name.c_str());
+        fuse_ino_t entry_ino = 0;
+        if (inode_table.find(entry_path, &entry_ino)) {
+            fuse_lowlevel_notify_inval_inode(session, entry_ino, 0, 0);
+        }
+        if (gone) {
+            inode_table.detach(entry_path);
+        }
+        if (output_name == name) {
+            break;
+        }
+    }
+}
+
+/*
+ * Tell the kernel to drop the attributes of an output whose size has become
+ * known, since it may have cached an estimated size for as long as the cache
+ * timeout. Its data is kept, since reads of the file may be in progress.
+ */
+void notify_output_size(const std::string& path) {
+    fuse_ino_t ino = 0;
+    if (inode_table.find(path, &ino)) {
+        fuse_lowlevel_notify_inval_inode(session, ino, -1, 0);
+    }
+}
+
+/*
+ * Negotiate the connection. Reads are made asynchronous so the kernel can
+ * keep several read-ahead requests in flight, and data from files is spliced
+ * to the kernel where possible. The read-ahead window is the largest the
+ * kernel offers, unless the max_readahead option lowers it, and the other
+ * connection options such as async_read can override these settings. The
+ * size of read requests is only limited by the max_read mount option and by
+ * the buffers libfuse negotiates.
+ */
+void mp3fs_ll_init(void* /*unused*/, struct fuse_conn_info* conn) {
+    conn->want |= conn->capable & (FUSE_CAP_ASYNC_READ | FUSE_CAP_SPLICE_WRITE |
+                                   FUSE_CAP_SPLICE_MOVE);
+    const unsigned int kernel_readahead = conn->max_readahead;
+    if (conn_opts != nullptr) {
+        fuse_apply_conn_info_opts(conn_opts, conn);
+    }
+    conn->max_readahead = std::min(conn->max_readahead, kernel_readahead);
+
+    mp3fs_set_output_size_callback(notify_output_size);
+    if (params.watch != 0) {
+        watching = start_source_watcher(notify_source_change);
+    }
+
+    Log(DEBUG) << "FUSE connection: protocol " << conn->proto_major << "."
+               << conn->proto_minor << ", max_read " << conn->max_read
+               << ", max_readahead " << conn->max_readahead
+               << ", capabilities " << std::hex << conn->want;
+}
+
+void mp3fs_ll_destroy(void* /*unused*/) {
+    stop_source_watcher();
+}
+
+void mp3fs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char* name) {
+    std::string parent_path;
+    if (!inode_path(req, parent, &parent_path)) {
+        return;
+    }
+
+    struct fuse_entry_param e;
+    int ret = make_entry(child_path(parent_path, name), &e);
+    if (ret == -ENOENT && params.negativetimeout > 0) {
+        // An entry without an inode tells the kernel to cache the miss.
+        e = {};
+        e.entry_timeout = params.negativetimeout;
+        fuse_reply_entry(req, &e);
+        return;
+    }
+    if (ret != 0) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+    fuse_reply_entry(req, &e);
+}
+
+void mp3fs_ll_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup) {
+    inode_table.forget(ino, nlookup);
+    fuse_reply_none(req);
+}
+
+void mp3fs_ll_forget_multi(fuse_req_t req, size_t count,
+                           struct fuse_forget_data* forgets) {
+    for (size_t i = 0; i < count; ++i) {
+        inode_table.forget(forgets[i].ino, forgets[i].nlookup);
+    }
+    fuse_reply_none(req);
+}
+
+void mp3fs_ll_getattr(fuse_req_t req, fuse_ino_t ino,
+                      struct fuse_file_info* /*unused*/) {
+    std::string path;
+    if (!inode_path(req, ino, &path)) {
+        return;
+    }
+
+    struct stat st = {};
+    int ret = mp3fs_getattr(path.c_str(), &st);
+    if (ret != 0) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+    st.st_ino = ino;
+    fuse_reply_attr(req, &st, cache_timeout());
+}
+
+void mp3fs_ll_readlink(fuse_req_t req, fuse_ino_t ino) {
+    std::string path;
+    if (!inode_path(req, ino, &path)) {
+        return;
+    }
+
+    char buf[PATH_MAX];
+    int ret = mp3fs_readlink(path.c_str(), buf, sizeof(buf));
+    if (ret != 0) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+    fuse_reply_readlink(req, buf);
+}
+
+void mp3fs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
+    std::string path;
+    if (!inode_path(req, ino, &path)) {
+        return;
+    }
+
+    std::unique_ptr<Reader> reader;
+    int ret = mp3fs_open_reader(path.c_str(), fi->flags, &reader);
+    if (ret != 0) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+
+    fi->fh = reinterpret_cast<uint64_t>(reader.get());
+    if (fuse_reply_open(req, fi) == 0) {
+        reader.release();
+    }
+}
+
+/*
+ * Data in a file is handed to libfuse as a file descriptor, so it can be
+ * spliced to the kernel without copying it through mp3fs. Data which is
+ * already in memory is written to the kernel straight from where the Reader
+ * keeps it, since fuse_reply_iov() is done with it before returning.
+ */
+void mp3fs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+                   struct fuse_file_info* fi) {
+    Log(INFO) << "read inode " << ino << ": " << size << " bytes from "
+              << offset;
+
+    auto* reader = reinterpret_cast<Reader*>(fi->fh);
+
+    const int fd = reader->fd();
+    if (fd != -1) {
+        struct fuse_bufvec buf = FUSE_BUFVEC_INIT(size);
+        buf.buf[0].flags =
+            static_cast<fuse_buf_flags>(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+        buf.buf[0].fd = fd;
+        buf.buf[0].pos = offset;
+        fuse_reply_data(req, &buf, FUSE_BUF_SPLICE_MOVE);
+        return;
+    }
+
+    if (reader->read_spans(offset, size,
+                           [req](const std::vector<struct iovec>& spans) {
+                               fuse_reply_iov(req, spans.data(),
+                                              static_cast<int>(spans.size()));
+                           })) {
+        return;
+    }
+
+    std::vector<char> data(size);
+    ssize_t read = reader->read(data.data(), offset, size);
+    if (read < 0) {
+        fuse_reply_err(req, errno);
+        return;
+    }
+    fuse_reply_buf(req, data.data(), static_cast<size_t>(read));
+}
+
+void mp3fs_ll_release(fuse_req_t req, fuse_ino_t ino,
+                      struct fuse_file_info* fi) {
+    Log(INFO) << "release inode " << ino;
+
+    delete reinterpret_cast<Reader*>(fi->fh);
+    fuse_reply_err(req, 0);
+}
+
+void mp3fs_ll_opendir(fuse_req_t req, fuse_ino_t ino,
+                      struct fuse_file_info* fi) {
+    std::unique_ptr<DirHandle> dir(new DirHandle);
+    if (!inode_path(req, ino, &dir->path)) {
+        return;
+    }
+
+    int ret = DirLister::Open(dir->path.c_str(), &dir->lister);
+    if (ret != 0) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+
+    fi->fh = reinterpret_cast<uint64_t>(dir.get());
+    if (fuse_reply_open(req, fi) == 0) {
+        dir.release();
+    }
+}
+
+/*
+ * Reply with as many entries from 'offset' on as fit in 'size' bytes. Entries
+ * are read from the source directory as they are sent, so a large directory
+ * is listed in pieces without holding all of it. With 'plus', each entry
+ * also carries its attributes, including the size of transcoded files, and a
+ * reference to its inode, so the kernel doesn't need to look up every file of
+ * a directory listing separately. An entry is sent without attributes if they
+ * can't be found, and the kernel will look it up again on access.
+ */
+void reply_readdir(fuse_req_t req, size_t size, off_t offset,
+                   struct fuse_file_info* fi, bool plus) {
+    auto* dir = reinterpret_cast<DirHandle*>(fi->fh);
+
+    std::vector<char> buf(size);
+    size_t used = 0;
+    int ret = dir->lister->read(offset, [&](const char* name,
+                                            const struct stat* st,
+                                            off_t next_offset) {
+        char* p = buf.data() + used;
+        const size_t remaining = size - used;
+
+        size_t entry_size = 0;
+        if (plus) {
+            struct fuse_entry_param e = {};
+            if (is_dot_or_dotdot(name) ||
+                make_entry(child_path(dir->path, name), &e) != 0) {
+                e = {};
+                e.attr = *st;
+            }
+            entry_size = fuse_add_direntry_plus(req, p, remaining, name, &e,
+                                                next_offset);
+            if (entry_size > remaining && e.ino != 0) {
+                inode_table.forget(e.ino, 1);
+            }
+        } else {
+            entry_size =
+                fuse_add_direntry(req, p, remaining, name, st, next_offset);
+        }
+
+        if (entry_size > remaining) {
+            return false;
+        }
+        used += entry_size;
+        return true;
+    });
+    if (ret != 0) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+
+    fuse_reply_buf(req, buf.data(), used);
+}
+
+void mp3fs_ll_readdir(fuse_req_t req, fuse_ino_t /*unused*/, size_t size,
+                      off_t offset, struct fuse_file_info* fi) {
+    reply_readdir(req, size, offset, fi, false);
+}
+
+void mp3fs_ll_readdirplus(fuse_req_t req, fuse_ino_t /*unused*/, size_t size,
+                          off_t offset, struct fuse_file_info* fi) {
+    reply_readdir(req, size, offset, fi, true);
+}
+
+void mp3fs_ll_releasedir(fuse_req_t req, fuse_ino_t /*unused*/,
+                         struct fuse_file_info* fi) {
+    delete reinterpret_cast<DirHandle*>(fi->fh);
+    fuse_reply_err(req, 0);
+}
+
+void mp3fs_ll_statfs(fuse_req_t req, fuse_ino_t ino) {
+    std::string path;
+    if (!inode_path(req, ino, &path)) {
+        return;
+    }
+
+    struct statvfs st = {};
+    int ret = mp3fs_statfs(path.c_str(), &st);
+    if (ret != 0) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+    fuse_reply_statfs(req, &st);
+}
+
+fuse_lowlevel_ops init_mp3fs_ll_ops() {
+    fuse_lowlevel_ops ops = {};
+
+    ops.init = mp3fs_ll_init;
+    ops.destroy = mp3fs_ll_destroy;
+    ops.lookup = mp3fs_ll_lookup;
+    ops.forget = mp3fs_ll_forget;
+    ops.forget_multi = mp3fs_ll_forget_multi;
+    ops.getattr = mp3fs_ll_getattr;
+    ops.readlink = mp3fs_ll_readlink;
+    ops.open = mp3fs_ll_open;
+    ops.read = mp3fs_ll_read;
+    ops.release = mp3fs_ll_release;
+    ops.opendir = mp3fs_ll_opendir;
+    ops.readdir = mp3fs_ll_readdir;
+    ops.readdirplus = mp3fs_ll_readdirplus;
+    ops.releasedir = mp3fs_ll_releasedir;
+    ops.statfs = mp3fs_ll_statfs;
+
+    return ops;
+}
+
+const fuse_lowlevel_ops mp3fs_ll_ops = init_mp3fs_ll_ops();
+
+}  // namespace
+
+void mp3fs_lowlevel_help() {
+    fuse_cmdline_help();
+    fuse_lowlevel_help();
+    std::cout << "    -o max_readahead=N     maximum read-ahead in bytes "
+                 "(default: kernel maximum)"
+              << std::endl;
+}
+
+/*
+ * Mount the filesystem and serve requests until it is unmounted. Requests are
+ * handled by a pool of threads unless -s is given; the pool can be tuned with
+ * the clone_fd and max_idle_threads options.
+ */
+int mp3fs_lowlevel_main(struct fuse_args* args) {
+    struct fuse_cmdline_opts opts = {};
+    if (fuse_parse_cmdline(args, &opts) != 0) {
+        return 1;
+    }
+    if (opts.mountpoint == nullptr) {
+        std::cerr << "No mount point specified." << std::endl;
+        return 1;
+    }
+    conn_opts = fuse_parse_conn_info_opts(args);
+    if (conn_opts == nullptr) {
+        free(opts.mountpoint);
+        return 1;
+    }
+
+    int ret = 1;
+    struct fuse_session* se =
+        fuse_session_new(args, &mp3fs_ll_ops, sizeof(mp3fs_ll_ops), nullptr);
+    session = se;
+    if (se != nullptr) {
+        if (fuse_set_signal_handlers(se) == 0) {
+            if (fuse_session_mount(se, opts.mountpoint) == 0) {
+                fuse_daemonize(opts.foreground);
+                if (opts.singlethread != 0) {
+                    ret = fuse_session_loop(se);
+                } else {
+                    struct fuse_loop_config config = {};
+                    config.clone_fd = opts.clone_fd;
+                    config.max_idle_threads = opts.max_idle_threads;
+                    ret = fuse_session_loop_mt(se, &config);
+                }
+                fuse_session_unmount(se);
+            }
+            fuse_remove_signal_handlers(se);
+        }
+        fuse_session_destroy(se);
+    }
+
+    free(conn_opts);
+    free(opts.mountpoint);
+    return ret != 0 ? 1 : 0;
+}
@@ -23,153 +23,66 @@
 
 #define FUSE_USE_VERSION 26
 
-#include <dirent.h>
-#include <fcntl.h>
 #include <fuse.h>
 #include <fuse_common.h>
 #include <sys/stat.h>
-#include <sys/statvfs.h>
-#include <unistd.h>
 
 #include <cerrno>
 #include <cstddef>
 #include <cstdint>
+#include <cstdlib>
 #include <memory>
 #include <ostream>
-#include <string>
 
-#include "codecs/coders.h"
 #include "logging.h"
 #include "mp3fs.h"
-#include "path.h"
+#include "operations.h"
 #include "reader.h"
-#include "transcode.h"
+#include "source_watcher.h"
 
 namespace {
 
-constexpr int kBytesPerBlock = 512;
-
-/**
- * Convert file extension from source to destination name.
- */
-std::string convert_extension(const std::string& path) {
-    size_t ext_pos = path.rfind('.');
-
-    if (ext_pos != std::string::npos &&
-        Decoder::CreateDecoder(path.substr(ext_pos + 1)) != nullptr) {
-        return path.substr(0, ext_pos + 1) + params.desttype;
-    }
-
-    return path;
-}
-
-int mp3fs_readlink(const char* p, char* buf, size_t size) {
-    Path path = Path::FromMp3fsRelative(p);
-    Log(INFO) << "readlink " << path;
-
-    ssize_t len = readlink(path.transcode_source().c_str(), buf, size - 2);
-    if (len == -1) {
-        return -errno;
+int mp3fs_opendir(const char* p, struct fuse_file_info* fi) {
+    std::unique_ptr<DirLister> lister;
+    int ret = DirLister::Open(p, &lister);
+    if (ret != 0) {
+        return ret;
     }
 
-    buf[len] = '\0';
-
-    size_t outlen = convert_extension(buf).copy(buf, size - 1);
-    buf[outlen] = '\0';
+    fi->fh = reinterpret_cast<uint64_t>(lister.release());
 
     return 0;
 }
 
-int mp3fs_readdir(const char* p, void* buf, fuse_fill_dir_t filler,
-                  off_t /*unused*/, struct fuse_file_info* /*unused*/) {
-    Path path = Path::FromMp3fsRelative(p);
-    Log(INFO) << "readdir " << path;
-
-    // Using a unique_ptr with a custom deleter ensures closedir gets called
-    // before function exit.
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wignored-attributes"
-    std::unique_ptr<DIR, decltype(&closedir)> dp(
-        opendir(path.normal_source().c_str()), closedir);
-#pragma GCC diagnostic pop
-    if (!dp) {
-        return -errno;
-    }
-
-    while (struct dirent* de = readdir(dp.get())) {
-        const std::string origfile = path.normal_source() + "/" + de->d_name;
-
-        struct stat st = {};
-        if (lstat(origfile.c_str(), &st) == -1) {
-            return -errno;
-        }
-
-        if (S_ISREG(st.st_mode) || S_ISLNK(st.st_mode)) {
-            size_t len = convert_extension(de->d_name)
-                             .copy(de->d_name, sizeof(de->d_name) - 1);
-            de->d_name[len] = '\0';
-        }
-
-        if (filler(buf, de->d_name, &st, 0) != 0) {
-            break;
-        }
-    }
-
-    return 0;
+/*
+ * Entries are passed with their offsets, so FUSE can list a large directory
+ * in several calls which each continue where the last one stopped.
+ */
+int mp3fs_readdir(const char* /*unused*/, void* buf, fuse_fill_dir_t filler,
+                  off_t offset, struct fuse_file_info* fi) {
+    auto* lister = reinterpret_cast<DirLister*>(fi->fh);
+    return lister->read(offset, [buf, filler](const char* name,
+                                              const struct stat* st,
+                                              off_t next_offset) {
+        return filler(buf, name, st, next_offset) == 0;
+    });
 }
 
-int mp3fs_getattr(const char* p, struct stat* stbuf) {
-    Path path = Path::FromMp3fsRelative(p);
-    Log(INFO) << "getattr " << path;
-
-    /* pass-through for regular files */
-    if (lstat(path.normal_source().c_str(), stbuf) == 0) {
-        return 0;
-    }
-
-    if (lstat(path.transcode_source().c_str(), stbuf) == -1) {
-        return -errno;
-    }
-
-    /*
-     * Get size for resulting mp3 from regular file, otherwise it's a
-     * symbolic link. */
-    if (S_ISREG(stbuf->st_mode)) {
-        Transcoder trans(path.transcode_source());
-        if (!trans.open()) {
-            return -errno;
-        }
-
-        stbuf->st_size = static_cast<off_t>(trans.get_size());
-        stbuf->st_blocks =
-            (stbuf->st_size + kBytesPerBlock - 1) / kBytesPerBlock;
-    }
+int mp3fs_releasedir(const char* /*unused*/, struct fuse_file_info* fi) {
+    delete reinterpret_cast<DirLister*>(fi->fh);
 
     return 0;
 }
 
 int mp3fs_open(const char* p, struct fuse_file_info* fi) {
-    Path path = Path::FromMp3fsRelative(p);
-    Log(INFO) << "open " << path;
-
-    int fd = open(path.normal_source().c_str(), fi->flags);
-
-    if (fd != -1) {  // File exists and was successfully opened.
-        fi->fh = reinterpret_cast<uint64_t>(new FileReader(fd));
-        return 0;
-    }
-    if (errno != ENOENT) {  // File exists but can't be opened.
-        return -errno;
+    std::unique_ptr<Reader> reader;
+    int ret = mp3fs_open_reader(p, fi->flags, &reader);
+    if (ret != 0) {
+        return ret;
     }
 
-    // File does not exist; try again after translating path.
-    std::unique_ptr<Transcoder> trans(new Transcoder(path.transcode_source()));
-    if (!trans->open()) {
-        return -errno;
-    }
-
-    /* Store transcoder in the fuse_file_info structure. */
-    fi->fh = reinterpret_cast<uint64_t>(trans.release());
+    /* Store reader in the fuse_file_info structure. */
+    fi->fh = reinterpret_cast<uint64_t>(reader.release());
 
     return 0;
 }
@@ -194,21 +107,64 @@ int mp3fs_read(const char* path, char* buf, size_t size, off_t offset,
     return -errno;
 }
 
-int mp3fs_statfs(const char* p, struct statvfs* stbuf) {
-    Path path = Path::FromMp3fsRelative(p);
-    Log(INFO) << "statfs " << path;
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(2, 9)
+/*
+ * When the data is in a file, such as a passthrough file or finished output
+ * in the transcode cache, hand FUSE the file descriptor so it can splice the
+ * data to the kernel without copying it through mp3fs. Anything else is read
+ * into a new memory buffer, which FUSE frees after replying.
+ */
+int mp3fs_read_buf(const char* path, struct fuse_bufvec** bufp, size_t size,
+                   off_t offset, struct fuse_file_info* fi) {
+    Log(INFO) << "read " << path << ": " << size << " bytes from " << offset;
 
-    /* pass-through for regular files */
-    if (statvfs(path.normal_source().c_str(), stbuf) == 0) {
-        return 0;
+    auto* reader = reinterpret_cast<Reader*>(fi->fh);
+
+    if (reader == nullptr) {
+        Log(ERROR) << "Tried to read from unopen file: " << path;
+        return -EBADF;
     }
 
-    if (statvfs(path.transcode_source().c_str(), stbuf) == 0) {
+    auto* bufvec = static_cast<fuse_bufvec*>(malloc(sizeof(fuse_bufvec)));
+    if (bufvec == nullptr) {
+        return -ENOMEM;
+    }
+    bufvec->count = 1;
+    bufvec->idx = 0;
+    bufvec->off = 0;
+    fuse_buf& buf = bufvec->buf[0];
+    buf.size = size;
+    buf.mem = nullptr;
+
+    buf.fd = reader->fd();
+    if (buf.fd != -1) {
+        buf.flags =
+            static_cast<fuse_buf_flags>(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+        buf.pos = offset;
+        *bufp = bufvec;
         return 0;
     }
 
-    return -errno;
+    buf.flags = static_cast<fuse_buf_flags>(0);
+    buf.pos = 0;
+    buf.mem = malloc(size);
+    if (buf.mem == nullptr) {
+        free(bufvec);
+        return -ENOMEM;
+    }
+
+    ssize_t read = reader->read(static_cast<char*>(buf.mem), offset, size);
+    if (read < 0) {
+        const int read_errno = errno;
+        free(buf.mem);
+        free(bufvec);
+        return -read_errno;
+    }
+    buf.size = static_cast<size_t>(read);
+    *bufp = bufvec;
+    return 0;
 }
+#endif
 
 int mp3fs_release(const char* path, struct fuse_file_info* fi) {
     Log(INFO) << "release " << path;
@@ -218,6 +174,19 @@ int mp3fs_release(const char* path, struct fuse_file_info* fi) {
     return 0;
 }
 
+/*
+ * Threads must be started here rather than before fuse_main(), since FUSE
+ * forks into the background in between.
+ */
+void* mp3fs_init(struct fuse_conn_info* /*unused*/) {
+    if (params.watch != 0) {
+        start_source_watcher(nullptr);
+    }
+    return nullptr;
+}
+
+void mp3fs_destroy(void* /*unused*/) { stop_source_watcher(); }
+
 fuse_operations init_mp3fs_ops() {
     fuse_operations ops = {};
 
@@ -225,9 +194,16 @@ fuse_operations init_mp3fs_ops() {
     ops.readlink = mp3fs_readlink;
     ops.open = mp3fs_open;
     ops.read = mp3fs_read;
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(2, 9)
+    ops.read_buf = mp3fs_read_buf;
+#endif
     ops.statfs = mp3fs_statfs;
     ops.release = mp3fs_release;
+    ops.opendir = mp3fs_opendir;
     ops.readdir = mp3fs_readdir;
+    ops.releasedir = mp3fs_releasedir;
+    ops.init = mp3fs_init;
+    ops.destroy = mp3fs_destroy;
 
     return ops;
 }
@@ -0,0 +1,51 @@
+/*
+ * Hash functions for mp3fs
+ *
+ * Copyright (C) 2021 K. Henriksson
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef MP3FS_HASH_H_
+#define MP3FS_HASH_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+constexpr uint64_t kFnvOffsetBasis = 0xcbf29ce484222325ULL;
+constexpr uint64_t kFnvPrime = 0x100000001b3ULL;
+
+/*
+ * Compute the 64-bit FNV-1a hash of the given data. Unlike std::hash, the
+ * result is stable across runs, so it can be used for data stored on disk.
+ * A previous hash may be passed to continue hashing from that value.
+ */
+inline uint64_t fnv1a_64(const void* data, size_t size,
+                         uint64_t hash = kFnvOffsetBasis) {
+    const auto* bytes = static_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= bytes[i];
+        hash *= kFnvPrime;
+    }
+    return hash;
+}
+
+inline uint64_t fnv1a_64(const std::string& str,
+                         uint64_t hash = kFnvOffsetBasis) {
+    return fnv1a_64(str.data(), str.size(), hash);
+}
+
+#endif  // MP3FS_HASH_H_
@@ -23,19 +23,27 @@
 
 #include <sys/stat.h>
 
+#ifdef HAVE_FUSE3
+#define FUSE_USE_VERSION 32
+
+#include <fuse_lowlevel.h>
+#else
 #define FUSE_USE_VERSION 26
 
 #include <fuse.h>
+#endif
 #include <fuse_common.h>
 #include <fuse_opt.h>
 #ifdef __APPLE__
 #include <fuse_darwin.h>
 #endif
 
+#include <cerrno>
 #include <cstddef>
 #include <cstdlib>
 #include <iostream>
 #include <memory>
+#include <sstream>
 #include <string>
 #include <utility>
 
@@ -43,8 +51,14 @@
 #include "logging.h"
 #include "mp3fs.h"
 
+#ifdef HAVE_FUSE3
+/* FUSE 3 low-level filesystem */
+int mp3fs_lowlevel_main(struct fuse_args* args);
+void mp3fs_lowlevel_help();
+#else
 /* Fuse operations struct */
 extern struct fuse_operations mp3fs_ops;
+#endif
 
 namespace {
 
@@ -64,12 +78,24 @@ enum { KEY_HELP, KEY_VERSION, KEY_KEEP_OPT };
     { templ, (unsigned int)(-1), key }
 
 struct fuse_opt mp3fs_opts[] = {
+    MP3FS_OPT("--attrcachesize=%u", attrcachesize, 0),
+    MP3FS_OPT("attrcachesize=%u", attrcachesize, 0),
+    MP3FS_OPT("--attrtimeout=%u", attrtimeout, 0),
+    MP3FS_OPT("attrtimeout=%u", attrtimeout, 0),
     MP3FS_OPT("-b %d", bitrate, 0),
     MP3FS_OPT("bitrate=%d", bitrate, 0),
+    MP3FS_OPT("--cachedir=%s", cachedir, 0),
+    MP3FS_OPT("cachedir=%s", cachedir, 0),
+    MP3FS_OPT("--cachesize=%u", cachesize, 0),
+    MP3FS_OPT("cachesize=%u", cachesize, 0),
     MP3FS_OPT("-d", debug, 1),
     MP3FS_OPT("debug", debug, 1),
     MP3FS_OPT("--desttype=%s", desttype, 0),
     MP3FS_OPT("desttype=%s", desttype, 0),
+    MP3FS_OPT("--encodeahead=%u", encodeahead, 0),
+    MP3FS_OPT("encodeahead=%u", encodeahead, 0),
+    MP3FS_OPT("--encodethreads=%u", encodethreads, 0),
+    MP3FS_OPT("encodethreads=%u", encodethreads, 0),
     MP3FS_OPT("--gainmode=%d", gainmode, 0),
     MP3FS_OPT("gainmode=%d", gainmode, 0),
     MP3FS_OPT("--gainref=%f", gainref, 0),
@@ -84,12 +110,26 @@ struct fuse_opt mp3fs_opts[] = {
     MP3FS_OPT("log_syslog", log_syslog, 1),
     MP3FS_OPT("--logfile=%s", logfile, 0),
     MP3FS_OPT("logfile=%s", logfile, 0),
+    MP3FS_OPT("--membudget=%u", membudget, 0),
+    MP3FS_OPT("membudget=%u", membudget, 0),
+    MP3FS_OPT("--negativetimeout=%u", negativetimeout, 0),
+    MP3FS_OPT("negativetimeout=%u", negativetimeout, 0),
+    MP3FS_OPT("--pipeline", pipeline, 1),
+    MP3FS_OPT("pipeline", pipeline, 1),
+    MP3FS_OPT("--prefetchthreads=%u", prefetchthreads, 0),
+    MP3FS_OPT("prefetchthreads=%u", prefetchthreads, 0),
     MP3FS_OPT("--quality=%d", quality, 0),
     MP3FS_OPT("quality=%d", quality, 0),
+    MP3FS_OPT("--seekable", seekable, 1),
+    MP3FS_OPT("seekable", seekable, 1),
+    MP3FS_OPT("--statcachefile=%s", statcachefile, 0),
+    MP3FS_OPT("statcachefile=%s", statcachefile, 0),
     MP3FS_OPT("--statcachesize=%u", statcachesize, 0),
     MP3FS_OPT("statcachesize=%u", statcachesize, 0),
     MP3FS_OPT("--vbr", vbr, 1),
     MP3FS_OPT("vbr", vbr, 1),
+    MP3FS_OPT("--watch", watch, 1),
+    MP3FS_OPT("watch", watch, 1),
 
     FUSE_OPT_KEY("-h", KEY_HELP),
     FUSE_OPT_KEY("--help", KEY_HELP),
@@ -110,6 +150,30 @@ Encoding options:
                            encoding bitrate: Acceptable values for RATE
                            include 96, 112, 128, 160, 192, 224, 256, and
                            320; 128 is the default
+    --attrcachesize=SIZE, -oattrcachesize=SIZE
+                           number of file attributes to cache, including
+                           files which don't exist or can't be decoded.
+                           Defaults to 0, meaning no cache.
+    --attrtimeout=SECS, -oattrtimeout=SECS
+                           seconds for which cached attributes are used
+                           without checking the source file, both by mp3fs
+                           and the kernel. Defaults to 1.
+    --cachedir=DIR, -ocachedir=DIR
+                           directory in which to keep finished output files,
+                           so they are not encoded again after being closed
+                           or after a restart. By default, nothing is cached.
+    --cachesize=SIZE, -ocachesize=SIZE
+                           maximum size in megabytes of the cache directory.
+                           The least recently used files are removed when it
+                           is exceeded. Defaults to 0, meaning no limit.
+    --encodeahead=SIZE, -oencodeahead=SIZE
+                           maximum amount in kilobytes to encode in the
+                           background ahead of sequential reads. Defaults
+                           to 0, meaning encoding only happens in reads.
+    --encodethreads=N, -oencodethreads=N
+                           number of extra threads encoding each file that
+                           is read, in parallel with the reads. Requires
+                           seekable. Defaults to 0.
     --gainmode=<0,1,2>, -ogainmode=<0,1,2>
                            what to do with ReplayGain tags:
                            0 - ignore, 1 - prefer album gain (default),
@@ -139,17 +203,45 @@ Encoding options:
     --logfile=FILE, -ologfile=FILE
                            file to output log messages to. By default, no
                            file will be written.
+    --membudget=SIZE, -omembudget=SIZE
+                           maximum memory in megabytes for the output of
+                           all open files. Least recently used data past
+                           this is moved to temporary files. Defaults to
+                           0, meaning no limit.
+    --negativetimeout=SECS, -onegativetimeout=SECS
+                           seconds for which a file is known not to exist,
+                           both by mp3fs and the kernel. Defaults to 0.
+    --pipeline, -opipeline
+                           decode and encode each file on two separate
+                           threads, so they run at the same time. Not
+                           allowed with seekable.
+    --prefetchthreads=N, -oprefetchthreads=N
+                           number of threads which find the sizes of files
+                           in a directory while it is being listed.
+                           Results are kept in the attribute cache, so
+                           attrcachesize must be set. Defaults to 0.
     --quality=<0..9>, -oquality=<0..9>
                            encoding quality: 0 is slowest, 9 is fastest;
                            5 is the default
+    --seekable, -oseekable
+                           encode the output in independent pieces, so a
+                           read anywhere in a file only encodes the data
+                           around it. Disables the bit reservoir, which
+                           slightly lowers quality. Not allowed with vbr.
+    --statcachefile=FILE, -ostatcachefile=FILE
+                           file in which to keep the file stats cache, so
+                           it is kept across restarts. Requires
+                           statcachesize to be set.
     --statcachesize=SIZE, -ostatcachesize=SIZE
                            Set the number of entries for the file stats
                            cache.  Necessary for decent performance when
-                           VBR is enabled.  Each entry takes 100-200 bytes.
+                           VBR is enabled.  Each entry takes about 90 bytes.
     --vbr, -ovbr           Use variable bit rate encoding.  When set, the
                            bit rate set with '-b' sets the maximum bit rate.
                            Performance will be terrible unless the
                            statcachesize is enabled.
+    --watch, -owatch       watch IN_DIR for changes, and drop cached
+                           information about files as soon as they change.
 
 General options:
     -h, --help             display this help and exit
@@ -184,8 +276,12 @@ int mp3fs_opt_proc(void* /*unused*/, const char* arg, int key,
 
         case KEY_HELP:
             usage(outargs->argv[0]);
+#ifdef HAVE_FUSE3
+            mp3fs_lowlevel_help();
+#else
             fuse_opt_add_arg(outargs, "-ho");
             fuse_main(outargs->argc, outargs->argv, &mp3fs_ops, nullptr);
+#endif
             exit(1);
 
         case KEY_VERSION:
@@ -202,12 +298,18 @@ int mp3fs_opt_proc(void* /*unused*/, const char* arg, int key,
 }  // namespace
 
 Mp3fsParams params = {
+    .attrcachesize = 0,
+    .attrtimeout = 1,
     .basepath = nullptr,
     .bitrate = kDefaultBitrate,
+    .cachedir = "",
+    .cachesize = 0,
     .debug = 0,
 #ifdef HAVE_MP3
     .desttype = "mp3",
 #endif
+    .encodeahead = 0,
+    .encodethreads = 0,
     .gainmode = 1,
     .gainref = kDefaultGainRef,
     .log_format = "[%T] tid=%I %L: %M",
@@ -215,11 +317,26 @@ Mp3fsParams params = {
     .log_stderr = 0,
     .log_syslog = 0,
     .logfile = "",
+    .membudget = 0,
+    .negativetimeout = 0,
+    .pipeline = 0,
+    .prefetchthreads = 0,
     .quality = kDefaultQuality,
+    .seekable = 0,
+    .statcachefile = "",
     .statcachesize = 0,
     .vbr = 0,
+    .watch = 0,
 };
 
+std::string encoding_params_key() {
+    std::ostringstream key;
+    key << params.desttype << ':' << params.bitrate << ':' << params.vbr << ':'
+        << params.quality << ':' << params.gainmode << ':' << params.gainref
+        << ':' << params.seekable;
+    return key.str();
+}
+
 int main(int argc, char* argv[]) {
     struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
 
@@ -271,6 +388,35 @@ int main(int argc, char* argv[]) {
         return 1;
     }
 
+    if (params.cachedir[0] != '\0' && params.cachedir[0] != '/') {
+        std::cerr << "cachedir must be an absolute path.\n" << std::endl;
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (params.cachedir[0] != '\0' &&
+        ((mkdir(params.cachedir, S_IRWXU) != 0 && errno != EEXIST) ||
+         stat(params.cachedir, &st) != 0 || !S_ISDIR(st.st_mode))) {
+        std::cerr << "cachedir is not a valid directory: " << params.cachedir
+                  << std::endl
+                  << std::endl;
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (params.statcachefile[0] != '\0' && params.statcachefile[0] != '/') {
+        std::cerr << "statcachefile must be an absolute path.\n" << std::endl;
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (params.statcachefile[0] != '\0' && params.statcachesize == 0) {
+        std::cerr << "statcachefile requires statcachesize to be set.\n"
+                  << std::endl;
+        usage(argv[0]);
+        return 1;
+    }
+
     if (params.quality > kQualityMax || params.quality < 0) {
         std::cerr << "Invalid encoding quality value: " << params.quality
                   << std::endl
@@ -279,6 +425,32 @@ int main(int argc, char* argv[]) {
         return 1;
     }
 
+    if (params.seekable != 0 && params.vbr != 0) {
+        std::cerr << "seekable cannot be used with vbr.\n" << std::endl;
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (params.encodethreads > 0 && params.seekable == 0) {
+        std::cerr << "encodethreads requires seekable to be set.\n"
+                  << std::endl;
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (params.pipeline != 0 && params.seekable != 0) {
+        std::cerr << "pipeline cannot be used with seekable.\n" << std::endl;
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (params.prefetchthreads > 0 && params.attrcachesize == 0) {
+        std::cerr << "prefetchthreads requires attrcachesize to be set.\n"
+                  << std::endl;
+        usage(argv[0]);
+        return 1;
+    }
+
     /* Check for valid destination type. */
     if (Encoder::CreateEncoder(params.desttype, nullptr) == nullptr) {
         std::cerr << "No encoder available for desttype: " << params.desttype
@@ -291,9 +463,15 @@ int main(int argc, char* argv[]) {
     print_versions(Log(DEBUG));
 
     Log(DEBUG) << "MP3FS options:" << std::endl
+               << "attrcachesize:  " << params.attrcachesize << std::endl
+               << "attrtimeout:    " << params.attrtimeout << std::endl
                << "basepath:       " << params.basepath << std::endl
                << "bitrate:        " << params.bitrate << std::endl
+               << "cachedir:       " << params.cachedir << std::endl
+               << "cachesize:      " << params.cachesize << std::endl
                << "desttype:       " << params.desttype << std::endl
+               << "encodeahead:    " << params.encodeahead << std::endl
+               << "encodethreads:  " << params.encodethreads << std::endl
                << "gainmode:       " << params.gainmode << std::endl
                << "gainref:        " << params.gainref << std::endl
                << "log_format:     " << params.log_format << std::endl
@@ -301,10 +479,28 @@ int main(int argc, char* argv[]) {
                << "log_stderr:     " << params.log_stderr << std::endl
                << "log_syslog:     " << params.log_syslog << std::endl
                << "logfile:        " << params.logfile << std::endl
+               << "membudget:      " << params.membudget << std::endl
+               << "negativetimeout: " << params.negativetimeout << std::endl
+               << "pipeline:       " << params.pipeline << std::endl
+               << "prefetchthreads: " << params.prefetchthreads << std::endl
                << "quality:        " << params.quality << std::endl
+               << "seekable:       " << params.seekable << std::endl
+               << "statcachefile:  " << params.statcachefile << std::endl
                << "statcachesize:  " << params.statcachesize << std::endl
-               << "vbr:            " << params.vbr;
+               << "vbr:            " << params.vbr << std::endl
+               << "watch:          " << params.watch;
 
     // start FUSE
+#ifdef HAVE_FUSE3
+    return mp3fs_lowlevel_main(args_ptr.get());
+#else
+    // Let the kernel cache attributes for as long as mp3fs does. Timeouts
+    // given on the command line come later, so they take precedence.
+    const std::string timeouts =
+        "-oattr_timeout=" + std::to_string(params.attrtimeout) +
+        ",entry_timeout=" + std::to_string(params.attrtimeout) +
+        ",negative_timeout=" + std::to_string(params.negativetimeout);
+    fuse_opt_insert_arg(args_ptr.get(), 1, timeouts.c_str());
     return fuse_main(args_ptr->argc, args_ptr->argv, &mp3fs_ops, nullptr);
+#endif
 }
@@ -22,12 +22,20 @@
 #ifndef MP3FS_MP3FS_H_
 #define MP3FS_MP3FS_H_
 
+#include <string>
+
 /* Global program parameters */
 struct Mp3fsParams {
+    unsigned int attrcachesize;
+    unsigned int attrtimeout;
     const char* basepath;
     int bitrate;
+    const char* cachedir;
+    unsigned int cachesize;
     int debug;
     const char* desttype;
+    unsigned int encodeahead;
+    unsigned int encodethreads;
     int gainmode;
     float gainref;
     const char* log_format;
@@ -35,11 +43,24 @@ struct Mp3fsParams {
     int log_stderr;
     int log_syslog;
     const char* logfile;
+    unsigned int membudget;
+    unsigned int negativetimeout;
+    int pipeline;
+    unsigned int prefetchthreads;
     int quality;
+    int seekable;
+    const char* statcachefile;
     unsigned int statcachesize;
     int vbr;
+    int watch;
 };
 
 extern Mp3fsParams params;
 
+/*
+ * Return a string describing every parameter which affects the encoded output.
+ * Two files transcoded with the same key will produce identical output.
+ */
+std::string encoding_params_key();
+
 #endif  // MP3FS_MP3FS_H_
@@ -0,0 +1,310 @@
+/*
+ * Filesystem operations source for mp3fs
+ *
+ * Copyright (C) 2006-2008 David Collett
+ * Copyright (C) 2008-2012 K. Henriksson
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include "operations.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <utility>
+
+#include "attr_cache.h"
+#include "codecs/coders.h"
+#include "logging.h"
+#include "mp3fs.h"
+#include "path.h"
+#include "prefetcher.h"
+#include "reader.h"
+#include "transcode.h"
+
+namespace {
+
+constexpr int kBytesPerBlock = 512;
+constexpr size_t kMaxPrefetchQueued = 4096;
+
+AttrCache attr_cache;
+// Set by the backend before any file is opened.
+output_size_callback_t output_size_callback;
+
+/*
+ * Find the attributes of a file, and the source file they came from, if
+ * there is one.
+ */
+int get_attributes(const Path& path, struct stat* stbuf, std::string* source) {
+    /* pass-through for regular files */
+    *source = path.normal_source();
+    if (lstat(source->c_str(), stbuf) == 0) {
+        return 0;
+    }
+
+    *source = path.transcode_source();
+    if (lstat(source->c_str(), stbuf) == -1) {
+        source->clear();
+        return -errno;
+    }
+
+    /*
+     * Get size for resulting mp3 from regular file, otherwise it's a
+     * symbolic link. */
+    if (S_ISREG(stbuf->st_mode)) {
+        size_t size = 0;
+        if (!Transcoder::GetSize(*source, stbuf->st_mtime, &size)) {
+            return -errno;
+        }
+
+        stbuf->st_size = static_cast<off_t>(size);
+        stbuf->st_blocks =
+            (stbuf->st_size + kBytesPerBlock - 1) / kBytesPerBlock;
+    }
+
+    return 0;
+}
+
+/*
+ * Get the attributes of a file, from the attribute cache if possible, and
+ * store them there otherwise.
+ */
+int lookup_attributes(const std::string& p, struct stat* stbuf) {
+    int ret = 0;
+    if (attr_cache.get(p, &ret, stbuf)) {
+        return ret;
+    }
+
+    std::string source;
+    ret = get_attributes(Path::FromMp3fsRelative(p.c_str()), stbuf, &source);
+    attr_cache.put(p, ret, *stbuf, source);
+    return ret;
+}
+
+/*
+ * Looks up the attributes of files in a directory being listed, in the
+ * background, since the next thing a client does is usually to get the
+ * attributes of each file. The results end up in the attribute and stats
+ * caches.
+ */
+Prefetcher& attr_prefetcher() {
+    static Prefetcher prefetcher(
+        [](const std::string& p) {
+            struct stat st = {};
+            lookup_attributes(p, &st);
+        },
+        params.prefetchthreads, kMaxPrefetchQueued);
+    return prefetcher;
+}
+
+}  // namespace
+
+/**
+ * Convert file extension from source to destination name.
+ */
+std::string convert_extension(const std::string& path) {
+    size_t ext_pos = path.rfind('.');
+
+    if (ext_pos != std::string::npos &&
+        Decoder::CanDecode(path.c_str() + ext_pos + 1)) {
+        return path.substr(0, ext_pos + 1) + params.desttype;
+    }
+
+    return path;
+}
+
+int mp3fs_readlink(const char* p, char* buf, size_t size) {
+    Path path = Path::FromMp3fsRelative(p);
+    Log(INFO) << "readlink " << path;
+
+    ssize_t len = readlink(path.transcode_source().c_str(), buf, size - 2);
+    if (len == -1) {
+        return -errno;
+    }
+
+    buf[len] = '\0';
+
+    size_t outlen = convert_extension(buf).copy(buf, size - 1);
+    buf[outlen] = '\0';
+
+    return 0;
+}
+
+DirLister::~DirLister() {
+    closedir(dp_);
+}
+
+int DirLister::Open(const char* p, std::unique_ptr<DirLister>* lister) {
+    Path path = Path::FromMp3fsRelative(p);
+    Log(INFO) << "opendir " << path;
+
+    DIR* dp = opendir(path.normal_source().c_str());
+    if (dp == nullptr) {
+        return -errno;
+    }
+    lister->reset(new DirLister(dp, p, path.normal_source()));
+    return 0;
+}
+
+/*
+ * The offsets are those from telldir(), so listing can continue from any
+ * entry without reading the directory from the start. The type of each entry
+ * is taken from readdir() where the source filesystem provides it, and only
+ * found with lstat() otherwise. Files which will be transcoded are queued for
+ * their attributes to be prefetched as they are listed.
+ */
+int DirLister::read(off_t offset, const readdir_filler_t& filler) {
+    Log(INFO) << "readdir " << path_ << " from " << offset;
+
+    const std::string prefix = path_ == "/" ? path_ : path_ + "/";
+    seek(offset);
+
+    while (struct dirent* de = readdir(dp_)) {
+        struct stat st = {};
+        st.st_ino = de->d_ino;
+#ifdef DT_UNKNOWN
+        if (de->d_type != DT_UNKNOWN) {
+            st.st_mode = DTTOIF(de->d_type);
+        } else
+#endif
+        {
+            const std::string origfile = source_ + "/" + de->d_name;
+            if (lstat(origfile.c_str(), &st) == -1) {
+                // The entry was removed since it was read.
+                errno = 0;
+                continue;
+            }
+        }
+
+        std::string name = de->d_name;
+        if (S_ISREG(st.st_mode) || S_ISLNK(st.st_mode)) {
+            name = convert_extension(name);
+        }
+
+        if (!filler(name.c_str(), &st, telldir(dp_))) {
+            break;
+        }
+        if (params.prefetchthreads > 0 && name != de->d_name) {
+            attr_prefetcher().queue(prefix + name);
+        }
+    }
+
+    return 0;
+}
+
+void DirLister::seek(off_t offset) {
+    if (offset == 0) {
+        rewinddir(dp_);
+    } else {
+        seekdir(dp_, offset);
+    }
+}
+
+int mp3fs_getattr(const char* p, struct stat* stbuf) {
+    Path path = Path::FromMp3fsRelative(p);
+    Log(INFO) << "getattr " << path;
+
+    if (params.prefetchthreads > 0) {
+        // Rather than repeat the work of a prefetch for this file, wait for
+        // it to finish and use its result.
+        attr_prefetcher().claim(p);
+    }
+    return lookup_attributes(p, stbuf);
+}
+
+void mp3fs_forget_attributes(const std::string& dir, const std::string& name) {
+    if (name.empty()) {
+        attr_cache.clear();
+        return;
+    }
+
+    const std::string prefix = dir == "/" ? dir : dir + "/";
+    attr_cache.remove(dir);
+    attr_cache.remove(prefix + name);
+    attr_cache.remove(prefix + convert_extension(name));
+}
+
+void mp3fs_forget_output_attributes(const std::string& source) {
+    const size_t base_length = strlen(params.basepath);
+    if (source.compare(0, base_length, params.basepath) != 0) {
+        return;
+    }
+
+    const size_t name_pos = source.rfind('/') + 1;
+    const std::string path =
+        source.substr(base_length, name_pos - base_length) +
+        convert_extension(source.substr(name_pos));
+    attr_cache.remove(path);
+    if (output_size_callback) {
+        output_size_callback(path);
+    }
+}
+
+void mp3fs_set_output_size_callback(output_size_callback_t on_size) {
+    output_size_callback = std::move(on_size);
+}
+
+int mp3fs_open_reader(const char* p, int flags,
+                      std::unique_ptr<Reader>* reader) {
+    Path path = Path::FromMp3fsRelative(p);
+    Log(INFO) << "open " << path;
+
+    int fd = open(path.normal_source().c_str(), flags);
+
+    if (fd != -1) {  // File exists and was successfully opened.
+        reader->reset(new FileReader(fd));
+        return 0;
+    }
+    if (errno != ENOENT) {  // File exists but can't be opened.
+        return -errno;
+    }
+
+    // File does not exist; try again after translating path.
+    std::unique_ptr<Reader> trans =
+        Transcoder::OpenShared(path.transcode_source());
+    if (!trans) {
+        return -errno;
+    }
+
+    *reader = std::move(trans);
+
+    return 0;
+}
+
+int mp3fs_statfs(const char* p, struct statvfs* stbuf) {
+    Path path = Path::FromMp3fsRelative(p);
+    Log(INFO) << "statfs " << path;
+
+    /* pass-through for regular files */
+    if (statvfs(path.normal_source().c_str(), stbuf) == 0) {
+        return 0;
+    }
+
+    if (statvfs(path.transcode_source().c_str(), stbuf) == 0) {
+        return 0;
+    }
+
+    return -errno;
+}
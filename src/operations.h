@@ -0,0 +1,115 @@
+/*
+ * Filesystem operations interface for mp3fs
+ *
+ * Copyright (C) 2021 K. Henriksson
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef MP3FS_OPERATIONS_H_
+#define MP3FS_OPERATIONS_H_
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "reader.h"
+
+/*
+ * The filesystem operations shared by the FUSE backends. Paths are relative to
+ * the mount point, starting with '/', and errors are returned as negative
+ * errno values like FUSE expects.
+ */
+
+/* Convert a source file name to the name shown through mp3fs. */
+std::string convert_extension(const std::string& path);
+
+int mp3fs_getattr(const char* p, struct stat* stbuf);
+
+/*
+ * Drop cached attributes after a change to the entry 'name' of the directory
+ * 'dir', given by its source name. An empty name drops everything.
+ */
+void mp3fs_forget_attributes(const std::string& dir, const std::string& name);
+
+/*
+ * Drop the cached attributes of the output for the source file 'source',
+ * given by its full path, after its size has become known.
+ */
+void mp3fs_forget_output_attributes(const std::string& source);
+
+/*
+ * Callback for an output whose size has become known, given by its path
+ * inside the mp3fs mount, so a backend can drop what the kernel has cached
+ * about it.
+ */
+using output_size_callback_t = std::function<void(const std::string& path)>;
+
+/* Set the callback for outputs whose size has become known. */
+void mp3fs_set_output_size_callback(output_size_callback_t on_size);
+
+int mp3fs_readlink(const char* p, char* buf, size_t size);
+
+/*
+ * Open a file for reading, either the source file itself or a transcoder for
+ * it. On success the Reader is stored in 'reader'.
+ */
+int mp3fs_open_reader(const char* p, int flags,
+                      std::unique_ptr<Reader>* reader);
+
+int mp3fs_statfs(const char* p, struct statvfs* stbuf);
+
+/*
+ * Callback for each directory entry, with its name as seen through mp3fs, its
+ * type and inode number in 'st', and the offset at which to continue listing
+ * after it. Returns false to stop listing.
+ */
+using readdir_filler_t = std::function<bool(
+    const char* name, const struct stat* st, off_t next_offset)>;
+
+/* An open directory in the mount, listed from its source directory. */
+class DirLister {
+ public:
+    ~DirLister();
+    DirLister(const DirLister&) = delete;
+    DirLister& operator=(const DirLister&) = delete;
+
+    /* Open a directory. On failure, returns a negative errno value. */
+    static int Open(const char* p, std::unique_ptr<DirLister>* lister);
+
+    /*
+     * List entries from 'offset', which is either 0 for the start or an
+     * offset passed to the filler earlier.
+     */
+    int read(off_t offset, const readdir_filler_t& filler);
+
+ private:
+    DirLister(DIR* dp, std::string path, std::string source)
+        : dp_(dp), path_(std::move(path)), source_(std::move(source)) {}
+
+    void seek(off_t offset);
+
+    DIR* dp_;
+    std::string path_;
+    std::string source_;
+};
+
+#endif  // MP3FS_OPERATIONS_H_
@@ -21,14 +21,146 @@
 #include "path.h"
 
 #include <dirent.h>
+#include <sys/stat.h>
 
+#include <cerrno>
 #include <cstddef>
+#include <cstring>
+#include <ctime>
+#include <list>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <unordered_map>
+#include <utility>
 
 #include "codecs/coders.h"
 #include "mp3fs.h"
 
+namespace {
+
+/* Maximum number of source directories to keep indexes for. */
+constexpr size_t kMaxIndexedDirs = 64;
+
+/*
+ * Indexes of source directories, mapping the name of each transcoded file as
+ * seen through mp3fs to the name of its source file. An index is built with a
+ * single pass over the directory, and is rebuilt when the modified time of the
+ * directory changes. The least recently used indexes are dropped when there
+ * are too many.
+ */
+class DirIndexCache {
+ public:
+    /*
+     * Find the source file name in 'dir' for the output file 'name'. Returns
+     * false if there is none.
+     */
+    bool find(const std::string& dir, const std::string& name,
+              std::string* source_name) {
+        struct stat st = {};
+        if (stat(dir.c_str(), &st) == -1) {
+            errno = 0;
+            return false;
+        }
+
+        std::lock_guard<std::mutex> l(mutex_);
+        auto it = indexes_.find(dir);
+        if (it == indexes_.end() || !it->second.current(st.st_mtime)) {
+            if (it != indexes_.end()) {
+                lru_.erase(it->second.lru_pos);
+                indexes_.erase(it);
+            }
+            it = build(dir, st.st_mtime);
+            if (it == indexes_.end()) {
+                return false;
+            }
+        } else {
+            lru_.splice(lru_.begin(), lru_, it->second.lru_pos);
+        }
+
+        auto source = it->second.sources.find(name);
+        if (source == it->second.sources.end()) {
+            return false;
+        }
+        *source_name = source->second;
+        return true;
+    }
+
+    /* Drop the index for 'dir', if there is one. */
+    void invalidate(const std::string& dir) {
+        std::lock_guard<std::mutex> l(mutex_);
+        auto it = indexes_.find(dir);
+        if (it != indexes_.end()) {
+            lru_.erase(it->second.lru_pos);
+            indexes_.erase(it);
+        }
+    }
+
+ private:
+    struct DirIndex {
+        time_t mtime;
+        // Time the index was built. Changes made in the same second as the
+        // directory's modified time may not be in the index, so it is only
+        // trusted once the directory is older than the index.
+        time_t built;
+        std::unordered_map<std::string, std::string> sources;
+        std::list<std::string>::iterator lru_pos;
+
+        bool current(time_t dir_mtime) const {
+            return dir_mtime == mtime && mtime < built;
+        }
+    };
+
+    using index_map_t = std::unordered_map<std::string, DirIndex>;
+
+    /*
+     * Read 'dir' and add an index for it, dropping the least recently used
+     * index if needed. If several source files map to the same output name,
+     * the first one listed wins. Assumes the cache is locked.
+     */
+    index_map_t::iterator build(const std::string& dir, time_t mtime) {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wignored-attributes"
+        std::unique_ptr<DIR, decltype(&closedir)> dp(opendir(dir.c_str()),
+                                                     closedir);
+#pragma GCC diagnostic pop
+        if (!dp) {
+            errno = 0;
+            return indexes_.end();
+        }
+
+        DirIndex index = {mtime, time(nullptr), {}, {}};
+        while (struct dirent* de = readdir(dp.get())) {
+            const char* dot = strrchr(de->d_name, '.');
+            if (dot == nullptr || !Decoder::CanDecode(dot + 1)) {
+                continue;
+            }
+            const std::string de_name = de->d_name;
+            index.sources.insert(std::make_pair(
+                de_name.substr(0, dot - de->d_name + 1) + params.desttype,
+                de_name));
+        }
+        errno = 0;
+
+        if (indexes_.size() >= kMaxIndexedDirs) {
+            indexes_.erase(lru_.back());
+            lru_.pop_back();
+        }
+        lru_.push_front(dir);
+        index.lru_pos = lru_.begin();
+        return indexes_.insert(std::make_pair(dir, std::move(index))).first;
+    }
+
+    std::mutex mutex_;
+    index_map_t indexes_;
+    // Directories with indexes, most recently used first.
+    std::list<std::string> lru_;
+};
+
+DirIndexCache dir_index_cache;
+
+}  // namespace
+
 std::string Path::normal_source() const {
     return std::string(params.basepath) + relative_path_;
 }
@@ -36,31 +168,25 @@ std::string Path::normal_source() const {
 std::string Path::transcode_source() const {
     const std::string source = normal_source();
     const size_t dot_idx = source.rfind('.');
-    const size_t slash_idx = source.rfind('/');
-    const std::string source_dir = source.substr(0, slash_idx);
 
     if (dot_idx != std::string::npos &&
         source.substr(dot_idx + 1) == params.desttype) {
-        const std::string source_base =
-            source.substr(slash_idx + 1, dot_idx - slash_idx);
-        std::unique_ptr<DIR, decltype(&closedir)> dp(
-            opendir(source_dir.c_str()), closedir);
-        while (struct dirent* de = readdir(dp.get())) {
-            std::string de_name = de->d_name;
-            if (de_name.find(source_base) == 0) {
-                const std::string de_ext =
-                    de_name.substr(de_name.rfind('.') + 1);
-                if (Decoder::CreateDecoder(de_ext) != nullptr) {
-                    /* This is a valid transcode source file. */
-                    return source_dir + "/" + de_name;
-                }
-            }
+        const size_t slash_idx = source.rfind('/');
+        const std::string source_dir = source.substr(0, slash_idx);
+        std::string source_name;
+        if (dir_index_cache.find(source_dir, source.substr(slash_idx + 1),
+                                 &source_name)) {
+            return source_dir + "/" + source_name;
         }
     }
 
     return source;
 }
 
+void Path::InvalidateSourceDir(const std::string& dir) {
+    dir_index_cache.invalidate(dir);
+}
+
 std::ostream& operator<<(std::ostream& ostream, const Path& path) {
     return ostream << path.relative_path_;
 }
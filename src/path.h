@@ -48,6 +48,12 @@ class Path {
      */
     std::string transcode_source() const;
 
+    /**
+     * Forget what is known about the contents of a source directory, after
+     * entries were added to it or removed from it.
+     */
+    static void InvalidateSourceDir(const std::string& dir);
+
     friend std::ostream& operator<<(std::ostream&, const Path&);
 
  private:
@@ -0,0 +1,116 @@
+/*
+ * PCM ring buffer source for mp3fs
+ *
+ * Copyright (C) 2021 K. Henriksson
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include "pcm_ring.h"
+
+#include <algorithm>
+
+PcmBlock* PcmRing::begin_push() {
+    const size_t pushed = pushed_.load(std::memory_order_relaxed);
+    if (!wait(&producer_waiting_,
+              [this, pushed] { return pushed - popped_ < blocks_.size(); })) {
+        return nullptr;
+    }
+    return &blocks_[pushed % blocks_.size()];
+}
+
+void PcmRing::end_push() {
+    ++pushed_;
+    wake(consumer_waiting_);
+}
+
+PcmBlock* PcmRing::begin_pop() {
+    const size_t popped = popped_.load(std::memory_order_relaxed);
+    if (!wait(&consumer_waiting_,
+              [this, popped] { return pushed_ != popped; })) {
+        return nullptr;
+    }
+    return &blocks_[popped % blocks_.size()];
+}
+
+void PcmRing::end_pop() {
+    ++popped_;
+    wake(producer_waiting_);
+}
+
+void PcmRing::close() {
+    closed_ = true;
+    std::lock_guard<std::mutex> l(wait_mutex_);
+    wait_cv_.notify_all();
+}
+
+/*
+ * Wait until ready() is true, returning false if the ring is closed first.
+ * The waiting flag is set before ready() is checked under the lock, and the
+ * other thread checks it after updating its counter, so with sequentially
+ * consistent atomics one of them always sees the other and no wakeup is lost.
+ */
+template <typename Ready>
+bool PcmRing::wait(std::atomic<bool>* waiting, Ready ready) {
+    if (ready() || closed_) {
+        return !closed_;
+    }
+
+    std::unique_lock<std::mutex> l(wait_mutex_);
+    *waiting = true;
+    wait_cv_.wait(l, [this, &ready] { return ready() || closed_; });
+    *waiting = false;
+    return !closed_;
+}
+
+void PcmRing::wake(const std::atomic<bool>& waiting) {
+    if (waiting) {
+        std::lock_guard<std::mutex> l(wait_mutex_);
+        wait_cv_.notify_all();
+    }
+}
+
+int RingEncoder::encode_pcm_data(const int32_t* const data[],
+                                 unsigned int numsamples,
+                                 unsigned int sample_size) {
+    PcmBlock* block = ring_->begin_push();
+    if (block == nullptr) {
+        return -1;
+    }
+
+    block->samples.resize(static_cast<size_t>(channels_) * numsamples);
+    for (unsigned int channel = 0; channel < channels_; ++channel) {
+        std::copy_n(data[channel], numsamples,
+                    block->samples.begin() + channel * numsamples);
+    }
+    block->channels = channels_;
+    block->numsamples = numsamples;
+    block->sample_size = sample_size;
+    block->status = 0;
+
+    ring_->end_push();
+    return 0;
+}
+
+void RingEncoder::push_end(int status) {
+    PcmBlock* block = ring_->begin_push();
+    if (block == nullptr) {
+        return;
+    }
+
+    block->numsamples = 0;
+    block->status = status;
+    ring_->end_push();
+}
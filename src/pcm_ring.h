@@ -0,0 +1,147 @@
+/*
+ * PCM ring buffer interface for mp3fs
+ *
+ * Copyright (C) 2021 K. Henriksson
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef MP3FS_PCM_RING_H_
+#define MP3FS_PCM_RING_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include "codecs/coders.h"
+
+/* A block of decoded audio, as passed to Encoder::encode_pcm_data(). */
+struct PcmBlock {
+    // Samples for each channel, one channel after another.
+    std::vector<int32_t> samples;
+    unsigned int channels = 0;
+    unsigned int numsamples = 0;
+    unsigned int sample_size = 0;
+    // 0 for audio data, 1 at the end of the input, -1 if decoding failed.
+    int status = 0;
+};
+
+/*
+ * Fixed size ring of PcmBlocks passed from one producer thread to one
+ * consumer thread. Blocks are filled and read in place, and passing a block
+ * only takes atomic operations. A thread only locks the ring to sleep when
+ * the ring is full or empty.
+ */
+class PcmRing {
+ public:
+    explicit PcmRing(size_t capacity) : blocks_(capacity) {}
+    ~PcmRing() = default;
+    PcmRing(const PcmRing&) = delete;
+    PcmRing& operator=(const PcmRing&) = delete;
+
+    /*
+     * Return the next block to fill, waiting until one is free. Returns
+     * nullptr if the ring has been closed. Only the producer may call this.
+     */
+    PcmBlock* begin_push();
+
+    /* Pass the block from begin_push() to the consumer. */
+    void end_push();
+
+    /*
+     * Return the oldest filled block, waiting until there is one. Returns
+     * nullptr if the ring has been closed. Only the consumer may call this.
+     */
+    PcmBlock* begin_pop();
+
+    /* Return the block from begin_pop() to the producer. */
+    void end_pop();
+
+    /* Wake up both threads and make all further waits fail. */
+    void close();
+
+ private:
+    template <typename Ready>
+    bool wait(std::atomic<bool>* waiting, Ready ready);
+    void wake(const std::atomic<bool>& waiting);
+
+    std::vector<PcmBlock> blocks_;
+    // Counts of blocks pushed and popped. The difference is the number of
+    // blocks in the ring.
+    std::atomic<size_t> pushed_ {0};
+    std::atomic<size_t> popped_ {0};
+
+    std::atomic<bool> closed_ {false};
+    std::atomic<bool> producer_waiting_ {false};
+    std::atomic<bool> consumer_waiting_ {false};
+    std::mutex wait_mutex_;
+    std::condition_variable wait_cv_;
+};
+
+/*
+ * Encoder which passes metadata straight through to another Encoder, but
+ * queues audio data in a PcmRing to be encoded on another thread.
+ */
+class RingEncoder : public Encoder {
+ public:
+    RingEncoder(Encoder* encoder, PcmRing* ring)
+        : encoder_(encoder), ring_(ring) {}
+
+    int set_stream_params(uint64_t num_samples, int sample_rate,
+                          int channels) override {
+        channels_ = static_cast<unsigned int>(channels);
+        return encoder_->set_stream_params(num_samples, sample_rate, channels);
+    }
+    void set_text_tag(int key, const char* value) override {
+        encoder_->set_text_tag(key, value);
+    }
+    void set_picture_tag(const char* mime_type, int type,
+                         const char* description, const uint8_t* data,
+                         unsigned int data_length) override {
+        encoder_->set_picture_tag(mime_type, type, description, data,
+                                  data_length);
+    }
+    void set_gain_db(double dbgain) override { encoder_->set_gain_db(dbgain); }
+    int render_tag(size_t file_size) override {
+        return encoder_->render_tag(file_size);
+    }
+    size_t calculate_size() const override {
+        return encoder_->calculate_size();
+    }
+    int encode_pcm_data(const int32_t* const data[], unsigned int numsamples,
+                        unsigned int sample_size) override;
+    int encode_finish() override { return encoder_->encode_finish(); }
+    bool no_partial_encode() override { return encoder_->no_partial_encode(); }
+    void final_range(size_t* offset, size_t* size) const override {
+        encoder_->final_range(offset, size);
+    }
+    bool tag_sizes(size_t* header, size_t* trailer) const override {
+        return encoder_->tag_sizes(header, trailer);
+    }
+    float volume_scale() const override { return encoder_->volume_scale(); }
+
+    /* Queue the end of the input, with the final status of the Decoder. */
+    void push_end(int status);
+
+ private:
+    Encoder* encoder_;
+    PcmRing* ring_;
+    unsigned int channels_ = 0;
+};
+
+#endif  // MP3FS_PCM_RING_H_
@@ -0,0 +1,85 @@
+/*
+ * Background prefetch source for mp3fs
+ *
+ * Copyright (C) 2021 K. Henriksson
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include "prefetcher.h"
+
+#include <algorithm>
+
+Prefetcher::~Prefetcher() {
+    {
+        std::lock_guard<std::mutex> l(mutex_);
+        stopping_ = true;
+    }
+    queued_cv_.notify_all();
+    for (std::thread& thread : threads_) {
+        thread.join();
+    }
+}
+
+void Prefetcher::queue(const std::string& key) {
+    std::lock_guard<std::mutex> l(mutex_);
+    if (num_threads_ == 0 || queue_.size() >= max_queued_ ||
+        queued_.count(key) != 0 || running_.count(key) != 0) {
+        return;
+    }
+
+    // Threads are started on first use rather than at startup, since FUSE
+    // may fork into the background in between.
+    if (threads_.empty()) {
+        for (size_t i = 0; i < num_threads_; ++i) {
+            threads_.emplace_back(&Prefetcher::run, this);
+        }
+    }
+
+    queue_.push_back(key);
+    queued_.insert(key);
+    queued_cv_.notify_one();
+}
+
+void Prefetcher::claim(const std::string& key) {
+    std::unique_lock<std::mutex> l(mutex_);
+    if (queued_.erase(key) != 0) {
+        queue_.erase(std::find(queue_.begin(), queue_.end(), key));
+        return;
+    }
+    finished_cv_.wait(l, [this, &key] { return running_.count(key) == 0; });
+}
+
+void Prefetcher::run() {
+    std::unique_lock<std::mutex> l(mutex_);
+    while (true) {
+        queued_cv_.wait(l, [this] { return stopping_ || !queue_.empty(); });
+        if (stopping_) {
+            return;
+        }
+
+        const std::string key = std::move(queue_.front());
+        queue_.pop_front();
+        queued_.erase(key);
+        running_.insert(key);
+
+        l.unlock();
+        work_(key);
+        l.lock();
+
+        running_.erase(key);
+        finished_cv_.notify_all();
+    }
+}
@@ -0,0 +1,79 @@
+/*
+ * Background prefetch interface for mp3fs
+ *
+ * Copyright (C) 2021 K. Henriksson
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef MP3FS_PREFETCHER_H_
+#define MP3FS_PREFETCHER_H_
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+/*
+ * Runs work for keys on a fixed number of background threads, started on
+ * first use. A key which is already queued or running is not queued again,
+ * and the queue has a maximum length, past which new keys are dropped.
+ */
+class Prefetcher {
+ public:
+    Prefetcher(std::function<void(const std::string&)> work, size_t threads,
+               size_t max_queued)
+        : work_(std::move(work)),
+          num_threads_(threads),
+          max_queued_(max_queued) {}
+    ~Prefetcher();
+    Prefetcher(const Prefetcher&) = delete;
+    Prefetcher& operator=(const Prefetcher&) = delete;
+
+    /* Queue work for 'key', unless it is already queued or running. */
+    void queue(const std::string& key);
+
+    /*
+     * Make sure no work for 'key' is pending, so the caller can do it
+     * itself. Work which is queued is removed from the queue, and work which
+     * is running is waited for.
+     */
+    void claim(const std::string& key);
+
+ private:
+    void run();
+
+    std::function<void(const std::string&)> work_;
+    size_t num_threads_;
+    size_t max_queued_;
+
+    std::mutex mutex_;
+    std::condition_variable queued_cv_;
+    std::condition_variable finished_cv_;
+    std::deque<std::string> queue_;
+    // Keys in queue_, for finding duplicates.
+    std::unordered_set<std::string> queued_;
+    std::unordered_set<std::string> running_;
+    std::vector<std::thread> threads_;
+    bool stopping_ = false;
+};
+
+#endif  // MP3FS_PREFETCHER_H_
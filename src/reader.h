@@ -21,15 +21,42 @@
 #ifndef MP3FS_READER_H_
 #define MP3FS_READER_H_
 
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include <cstddef>
+#include <functional>
+#include <vector>
+
+/*
+ * Callback for the data of a range, given as the spans of memory holding it
+ * in order. The spans are only valid during the call.
+ */
+using span_callback_t =
+    std::function<void(const std::vector<struct iovec>& spans)>;
 
 class Reader {
  public:
     /** Read bytes into the internal buffer and into the given buffer. */
     virtual ssize_t read(char* buff, off_t offset, size_t len) = 0;
 
+    /**
+     * Return a file descriptor holding the same data at the same offsets,
+     * which can be read directly instead of calling read(), or -1 if there is
+     * none. The descriptor remains owned by the Reader.
+     */
+    virtual int fd() { return -1; }
+
+    /**
+     * If the whole range is already in memory, pass it to 'callback' without
+     * copying it, and return true. Otherwise return false, and read() must be
+     * used instead.
+     */
+    virtual bool read_spans(off_t /*offset*/, size_t /*len*/,
+                            const span_callback_t& /*callback*/) {
+        return false;
+    }
+
     virtual ~Reader() = default;
 };
 
@@ -43,6 +70,8 @@ class FileReader : public Reader {
         return pread(fd_, buff, len, offset);
     }
 
+    int fd() override { return fd_; }
+
  private:
     int fd_;
 };
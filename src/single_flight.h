@@ -0,0 +1,88 @@
+/*
+ * Duplicate call suppression for mp3fs
+ *
+ * Copyright (C) 2021 K. Henriksson
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef MP3FS_SINGLE_FLIGHT_H_
+#define MP3FS_SINGLE_FLIGHT_H_
+
+#include <cerrno>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+/*
+ * Runs a computation once for all callers which ask for the same key at the
+ * same time. The first caller runs it, and the others wait for its result
+ * instead of repeating the work. Once the result is returned, the next call
+ * for the key runs the computation again, so results are not cached.
+ */
+template <typename T>
+class SingleFlight {
+ public:
+    SingleFlight() = default;
+    SingleFlight(const SingleFlight&) = delete;
+    SingleFlight& operator=(const SingleFlight&) = delete;
+
+    /*
+     * Return the result of 'compute' for 'key', run either by this caller or
+     * by one which is already running it. The errno left by 'compute' is set
+     * for every caller.
+     */
+    template <typename Compute>
+    T run(const std::string& key, Compute compute) {
+        std::unique_lock<std::mutex> l(mutex_);
+        auto it = calls_.find(key);
+        if (it != calls_.end()) {
+            std::shared_ptr<Call> call = it->second;
+            call->done_cv.wait(l, [&call] { return call->done; });
+            errno = call->error;
+            return call->result;
+        }
+
+        std::shared_ptr<Call> call(new Call);
+        calls_[key] = call;
+        l.unlock();
+
+        T result = compute();
+        const int error = errno;
+
+        l.lock();
+        call->result = result;
+        call->error = error;
+        call->done = true;
+        calls_.erase(key);
+        call->done_cv.notify_all();
+        return result;
+    }
+
+ private:
+    struct Call {
+        std::condition_variable done_cv;
+        bool done = false;
+        T result = T();
+        int error = 0;
+    };
+
+    std::mutex mutex_;
+    std::map<std::string, std::shared_ptr<Call>> calls_;
+};
+
+#endif  // MP3FS_SINGLE_FLIGHT_H_
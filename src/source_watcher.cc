@@ -0,0 +1,284 @@
+/*
+ * Source directory watcher source for mp3fs
+ *
+ * Copyright (C) 2021 K. Henriksson
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include "source_watcher.h"
+
+#ifdef HAVE_SYS_INOTIFY_H
+
+#include <dirent.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "logging.h"
+#include "mp3fs.h"
+#include "operations.h"
+#include "path.h"
+#include "transcode.h"
+
+namespace {
+
+constexpr uint32_t kWatchMask = IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+                                IN_MOVED_TO | IN_CLOSE_WRITE | IN_ATTRIB |
+                                IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK;
+constexpr size_t kEventBufferSize = 64 * 1024;
+
+/*
+ * Watches every directory under the base path with inotify. inotify does not
+ * watch subdirectories itself, so watches are added as directories appear
+ * and removed as they move away.
+ */
+class SourceWatcher {
+ public:
+    explicit SourceWatcher(source_change_callback_t on_change)
+        : on_change_(std::move(on_change)) {}
+
+    ~SourceWatcher() {
+        if (inotify_fd_ != -1) {
+            close(inotify_fd_);
+        }
+        if (stop_pipe_[0] != -1) {
+            close(stop_pipe_[0]);
+            close(stop_pipe_[1]);
+        }
+    }
+
+    SourceWatcher(const SourceWatcher&) = delete;
+    SourceWatcher& operator=(const SourceWatcher&) = delete;
+
+    bool start() {
+        inotify_fd_ = inotify_init1(IN_CLOEXEC);
+        if (inotify_fd_ == -1 || pipe(stop_pipe_) == -1) {
+            Log(ERROR) << "Failed to start watching source directory: "
+                       << strerror(errno);
+            errno = 0;
+            return false;
+        }
+
+        add_watches(params.basepath);
+        Log(INFO) << "Watching " << dirs_.size() << " source directories";
+
+        thread_ = std::thread(&SourceWatcher::run, this);
+        return true;
+    }
+
+    void stop() {
+        if (thread_.joinable()) {
+            const char c = 0;
+            while (write(stop_pipe_[1], &c, 1) == -1 && errno == EINTR) {
+            }
+            thread_.join();
+        }
+    }
+
+ private:
+    /* Watch 'dir' and every directory below it. */
+    void add_watches(const std::string& dir) {
+        int wd = inotify_add_watch(inotify_fd_, dir.c_str(), kWatchMask);
+        if (wd == -1) {
+            if (errno == ENOSPC && !warned_limit_) {
+                Log(ERROR) << "Too many source directories to watch. Raise "
+                              "fs.inotify.max_user_watches to watch them all.";
+                warned_limit_ = true;
+            }
+            errno = 0;
+            return;
+        }
+        dirs_[wd] = dir;
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wignored-attributes"
+        std::unique_ptr<DIR, decltype(&closedir)> dp(opendir(dir.c_str()),
+                                                     closedir);
+#pragma GCC diagnostic pop
+        if (!dp) {
+            errno = 0;
+            return;
+        }
+
+        while (struct dirent* de = readdir(dp.get())) {
+            const std::string name = de->d_name;
+            if (name == "." || name == "..") {
+                continue;
+            }
+            const std::string path = dir + "/" + name;
+            struct stat st = {};
+            if (lstat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+                add_watches(path);
+            }
+        }
+        errno = 0;
+    }
+
+    /* Stop watching 'dir' and every directory below it. */
+    void remove_watches(const std::string& dir) {
+        const std::string prefix = dir + "/";
+        for (auto it = dirs_.begin(); it != dirs_.end();) {
+            if (it->second == dir ||
+                it->second.compare(0, prefix.size(), prefix) == 0) {
+                inotify_rm_watch(inotify_fd_, it->first);
+                it = dirs_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    void run() {
+        std::vector<char> buf(kEventBufferSize);
+        struct pollfd fds[2] = {{inotify_fd_, POLLIN, 0},
+                                {stop_pipe_[0], POLLIN, 0}};
+
+        while (true) {
+            if (poll(fds, 2, -1) == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                Log(ERROR) << "Failed to wait for source directory changes: "
+                           << strerror(errno);
+                break;
+            }
+            if (fds[1].revents != 0) {
+                break;
+            }
+
+            ssize_t len = read(inotify_fd_, buf.data(), buf.size());
+            if (len <= 0) {
+                continue;
+            }
+            for (ssize_t pos = 0; pos < len;) {
+                const auto* event =
+                    reinterpret_cast<const struct inotify_event*>(&buf[pos]);
+                handle_event(*event);
+                pos += static_cast<ssize_t>(sizeof(struct inotify_event) +
+                                            event->len);
+            }
+        }
+        errno = 0;
+    }
+
+    void handle_event(const struct inotify_event& event) {
+        if ((event.mask & IN_Q_OVERFLOW) != 0) {
+            Log(INFO) << "Missed source directory changes, dropping all "
+                         "directory information";
+            for (const auto& dir : dirs_) {
+                changed(dir.second, "", false);
+            }
+            return;
+        }
+
+        auto it = dirs_.find(event.wd);
+        if (it == dirs_.end()) {
+            return;
+        }
+        if ((event.mask & IN_IGNORED) != 0) {
+            dirs_.erase(it);
+            return;
+        }
+
+        const std::string dir = it->second;
+        const std::string name = event.len > 0 ? event.name : "";
+        const std::string path = dir + "/" + name;
+        if ((event.mask & IN_ISDIR) != 0) {
+            if ((event.mask & (IN_CREATE | IN_MOVED_TO)) != 0) {
+                add_watches(path);
+            } else if ((event.mask & IN_MOVED_FROM) != 0) {
+                remove_watches(path);
+            }
+        } else {
+            Transcoder::ForgetSource(path);
+        }
+
+        changed(dir, name, (event.mask & (IN_MOVED_FROM | IN_DELETE)) != 0);
+    }
+
+    /* Drop information about the entry 'name' of the source directory. */
+    void changed(const std::string& dir, const std::string& name, bool gone) {
+        Log(DEBUG) << "Source changed: " << dir << "/" << name;
+
+        Path::InvalidateSourceDir(dir);
+        std::string relative = dir.substr(strlen(params.basepath));
+        if (relative.empty()) {
+            relative = "/";
+        }
+        mp3fs_forget_attributes(relative, name);
+        if (on_change_) {
+            on_change_(relative, name, gone);
+        }
+    }
+
+    source_change_callback_t on_change_;
+    int inotify_fd_ = -1;
+    int stop_pipe_[2] = {-1, -1};
+    // Source directory for each watch descriptor. Only used by the watcher
+    // thread once it has started.
+    std::unordered_map<int, std::string> dirs_;
+    bool warned_limit_ = false;
+    std::thread thread_;
+};
+
+std::unique_ptr<SourceWatcher> source_watcher;
+
+}  // namespace
+
+bool start_source_watcher(source_change_callback_t on_change) {
+    std::unique_ptr<SourceWatcher> watcher(
+        new SourceWatcher(std::move(on_change)));
+    if (!watcher->start()) {
+        return false;
+    }
+    source_watcher = std::move(watcher);
+    return true;
+}
+
+void stop_source_watcher() {
+    if (source_watcher) {
+        source_watcher->stop();
+        source_watcher.reset();
+    }
+}
+
+#else
+
+#include <ostream>
+
+#include "logging.h"
+
+bool start_source_watcher(source_change_callback_t /*unused*/) {
+    Log(ERROR) << "Watching the source directory is not supported on this "
+                  "system";
+    return false;
+}
+
+void stop_source_watcher() {}
+
+#endif
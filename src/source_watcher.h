@@ -0,0 +1,48 @@
+/*
+ * Source directory watcher interface for mp3fs
+ *
+ * Copyright (C) 2021 K. Henriksson
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef MP3FS_SOURCE_WATCHER_H_
+#define MP3FS_SOURCE_WATCHER_H_
+
+#include <functional>
+#include <string>
+
+/*
+ * Callback for a change in the source directory, given the directory as a
+ * path inside the mp3fs mount and the source name of the entry which was
+ * created, changed, moved or removed. The name is empty if any entry of the
+ * directory may have changed. 'gone' is set if the entry was moved away or
+ * removed.
+ */
+using source_change_callback_t = std::function<void(
+    const std::string& dir, const std::string& name, bool gone)>;
+
+/*
+ * Start a thread watching the source directory tree for changes, and
+ * dropping the cached information about changed files. 'on_change' is also
+ * called for each change if it is set. Returns false if the watcher could not
+ * be started.
+ */
+bool start_source_watcher(source_change_callback_t on_change);
+
+/* Stop the thread started by start_source_watcher(). */
+void stop_source_watcher();
+
+#endif  // MP3FS_SOURCE_WATCHER_H_
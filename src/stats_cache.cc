@@ -20,17 +20,71 @@
 
 #include "stats_cache.h"
 
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
 #include <algorithm>
 #include <cerrno>
-#include <iterator>
+#include <cstring>
+#include <limits>
 #include <ostream>
-#include <vector>
 
+#include "hash.h"
 #include "logging.h"
 #include "mp3fs.h"
 
+namespace {
+
+/* Header at the start of the persistent cache file. */
+struct FileHeader {
+    char magic[8];
+    uint64_t capacity;
+};
+
+constexpr char kFileMagic[] = "MP3FSSC2";
+static_assert(sizeof(kFileMagic) == sizeof(FileHeader::magic) + 1,
+              "magic must fill the header field");
+
+// Minimum number of records in a new cache file.
+constexpr size_t kMinCapacity = 64;
+// Number of slots checked for a given key before overwriting an old record.
+constexpr size_t kMaxProbe = 16;
+// Starting value for the second hash of file names, instead of the FNV one.
+constexpr uint64_t kNameCheckBasis = 0x6d70336673636b31ULL;
+
+uint32_t record_check(uint64_t key, uint64_t name_check, uint64_t size,
+                      int64_t mtime, uint32_t params_hash) {
+    uint64_t hash = fnv1a_64(&key, sizeof(key));
+    hash = fnv1a_64(&name_check, sizeof(name_check), hash);
+    hash = fnv1a_64(&size, sizeof(size), hash);
+    hash = fnv1a_64(&mtime, sizeof(mtime), hash);
+    return static_cast<uint32_t>(
+        fnv1a_64(&params_hash, sizeof(params_hash), hash));
+}
+
+/*
+ * Check the capacity from the header of an existing file. Slots are found by
+ * masking the key, so it must be a power of two, and the size of the file
+ * must fit in both size_t and off_t.
+ */
+bool valid_capacity(uint64_t capacity, size_t record_size) {
+    const uint64_t max_file_size =
+        std::min<uint64_t>(std::numeric_limits<size_t>::max(),
+                           std::numeric_limits<off_t>::max());
+    return capacity != 0 && (capacity & (capacity - 1)) == 0 &&
+           capacity <= (max_file_size - sizeof(FileHeader)) / record_size;
+}
+
+}  // namespace
+
+StatsCache::~StatsCache() {
+    if (map_ != nullptr) {
+        munmap(map_, map_size_);
+    }
+}
+
 /*
  * Get the file size from the cache for the given filename, if it exists.
  * Use 'mtime' as the modified time of the file to check for an invalid cache
@@ -38,127 +92,280 @@
  */
 bool StatsCache::get_filesize(const std::string& filename, time_t mtime,
                               size_t* filesize) {
-    std::lock_guard<std::mutex> l(mutex_);
-    auto it = cache_.find(filename);
-    if (it != cache_.end()) {
-        FileStat& file_stat = it->second;
-        if (mtime > file_stat.get_mtime()) {
-            // The decoded file has changed since this entry was created, so
-            // remove the invalid entry.
-            Log(DEBUG) << "Removed out of date file '" << it->first
-                       << "' from stats cache";
-            cache_.erase(it);
-        } else {
-            Log(DEBUG) << "Found file '" << it->first
-                       << "' in stats cache with size " << file_stat.get_size();
-            *filesize = file_stat.get_size();
-            file_stat.update_atime();
-            return true;
-        }
+    const uint64_t key = Key(filename);
+    const uint64_t name_check = NameCheck(filename);
+    Shard& s = shard(key);
+    std::lock_guard<std::mutex> l(s.mutex);
+    auto it = s.entries.find(key);
+    if (it == s.entries.end() && load_record(&s, key, name_check)) {
+        it = s.entries.find(key);
+    }
+    if (it == s.entries.end() || it->second.name_check != name_check) {
+        return false;
     }
-    return false;
+
+    Entry& entry = it->second;
+    if (mtime > entry.mtime) {
+        // The decoded file has changed since this entry was created, so
+        // remove the invalid entry.
+        Log(DEBUG) << "Removed out of date file '" << filename
+                   << "' from stats cache";
+        Unlink(&entry);
+        s.entries.erase(it);
+        remove_record(key);
+        return false;
+    }
+
+    Log(DEBUG) << "Found file '" << filename << "' in stats cache with size "
+               << entry.size;
+    *filesize = static_cast<size_t>(entry.size);
+    Unlink(&entry);
+    PushFront(&s, &entry);
+    return true;
 }
 
 /* Add or update an entry in the stats cache */
 
 void StatsCache::put_filesize(const std::string& filename, size_t filesize,
                               time_t mtime) {
-    const FileStat file_stat(filesize, mtime);
-    std::unique_lock<std::mutex> l(mutex_);
-    auto it = cache_.find(filename);
-    if (it == cache_.end()) {
+    const uint64_t key = Key(filename);
+    const uint64_t name_check = NameCheck(filename);
+    Shard& s = shard(key);
+    std::lock_guard<std::mutex> l(s.mutex);
+    auto it = s.entries.find(key);
+    if (it == s.entries.end()) {
         Log(DEBUG) << "Added file '" << filename
-                   << "' to stats cache with size " << file_stat.get_size();
-        cache_.insert(std::make_pair(filename, file_stat));
-    } else if (mtime >= it->second.get_mtime()) {
+                   << "' to stats cache with size " << filesize;
+        store_record(*insert(&s, key, name_check, filesize, mtime));
+    } else if (mtime >= it->second.mtime ||
+               it->second.name_check != name_check) {
         Log(DEBUG) << "Updated file '" << filename
-                   << "' in stats cache with size " << file_stat.get_size();
-        it->second = file_stat;
+                   << "' in stats cache with size " << filesize;
+        Entry& entry = it->second;
+        entry.name_check = name_check;
+        entry.size = filesize;
+        entry.mtime = mtime;
+        Unlink(&entry);
+        PushFront(&s, &entry);
+        store_record(entry);
+    }
+}
+
+/* Remove the entry for a file which has changed or been removed. */
+void StatsCache::remove_filesize(const std::string& filename) {
+    const uint64_t key = Key(filename);
+    Shard& s = shard(key);
+    std::lock_guard<std::mutex> l(s.mutex);
+    auto it = s.entries.find(key);
+    if (it != s.entries.end()) {
+        Log(DEBUG) << "Removed changed file '" << filename
+                   << "' from stats cache";
+        Unlink(&it->second);
+        s.entries.erase(it);
     }
-    if (cache_.size() > params.statcachesize) {
-        // Don't hold lock when calling prune.
-        l.unlock();
-        prune();
+    remove_record(key);
+}
+
+uint64_t StatsCache::Key(const std::string& filename) {
+    uint64_t key = fnv1a_64(filename);
+    // Zero marks an empty slot in the cache file.
+    return key != 0 ? key : 1;
+}
+
+uint64_t StatsCache::NameCheck(const std::string& filename) {
+    return fnv1a_64(filename, kNameCheckBasis);
+}
+
+void StatsCache::Unlink(Entry* entry) {
+    entry->prev->next = entry->next;
+    entry->next->prev = entry->prev;
+}
+
+void StatsCache::PushFront(Shard* shard, Entry* entry) {
+    entry->prev = &shard->lru;
+    entry->next = shard->lru.next;
+    shard->lru.next->prev = entry;
+    shard->lru.next = entry;
+}
+
+/*
+ * Add a new entry as the most recently used in its shard, evicting the least
+ * recently used entry if the shard is full. Each shard holds an equal part of
+ * statcachesize entries. Evicted entries stay in the cache file. Assumes the
+ * shard is locked.
+ */
+StatsCache::Entry* StatsCache::insert(Shard* shard, uint64_t key,
+                                      uint64_t name_check, uint64_t size,
+                                      int64_t mtime) {
+    const size_t shard_capacity =
+        (params.statcachesize + kShards - 1) / kShards;
+    if (shard->entries.size() >= shard_capacity && !shard->entries.empty()) {
+        Entry* oldest = shard->lru.prev;
+        Unlink(oldest);
+        shard->entries.erase(oldest->key);
     }
+
+    Entry& entry = shard->entries[key];
+    entry = {key, name_check, size, mtime, nullptr, nullptr};
+    PushFront(shard, &entry);
+    return &entry;
 }
 
 /*
- * Prune invalid and old cache entries until the cache is at 90% of capacity.
+ * Map the persistent cache file given by the statcachefile option into
+ * memory, creating it if necessary. Records are only read when they are
+ * looked up, so this does not read the whole file. Assumes the file is
+ * locked. Returns false if no file is in use.
  */
-void StatsCache::prune() {
-    Log(DEBUG) << "Pruning stats cache";
-    const size_t target_size = 9 * params.statcachesize / 10;  // 90% NOLINT
-
-    /* Copy all the entries to a vector to be sorted. */
-    std::vector<cache_entry_t> sorted_entries;
-    {
-        std::lock_guard<std::mutex> l(mutex_);
-        std::copy(cache_.begin(), cache_.end(),
-                  std::back_inserter(sorted_entries));
-    }
-    /* Sort the entries by access time, with the oldest first */
-    std::sort(sorted_entries.begin(), sorted_entries.end(),
-              [](const cache_entry_t& a, const cache_entry_t& b) {
-                  return a.second.get_atime() < b.second.get_atime();
-              });
-
-    /*
-     * Remove all invalid cache entries. Don't bother removing invalid
-     * entries from sorted_entries, as the removal from a vector can have bad
-     * performance and removing the entry twice (once here and once in the next
-     * loop) is harmless.
-     *
-     * Lock the cache for each entry removed instead of putting the lock around
-     * the entire loop because the stat() can be expensive.
-     */
-    for (const auto& e : sorted_entries) {
-        const std::string& decoded_file = e.first;
-        const FileStat& file_stat = e.second;
-        struct stat s = {};
-        if (stat(decoded_file.c_str(), &s) < 0 ||
-            s.st_mtime > file_stat.get_mtime()) {
-            Log(DEBUG) << "Removed out of date file '" << decoded_file
-                       << "' from stats cache";
+bool StatsCache::map_file() {
+    if (map_attempted_) {
+        return map_ != nullptr;
+    }
+    map_attempted_ = true;
+    if (params.statcachefile == nullptr || params.statcachefile[0] == '\0') {
+        return false;
+    }
+
+    params_hash_ = static_cast<uint32_t>(fnv1a_64(encoding_params_key()));
+
+    int fd = open(params.statcachefile, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    if (fd == -1) {
+        Log(ERROR) << "Failed to open stats cache file: " << strerror(errno);
+        errno = 0;
+        return false;
+    }
+
+    // Use the capacity of an existing valid file, so changing statcachesize
+    // doesn't throw away its contents.
+    FileHeader header = {};
+    struct stat s = {};
+    if (pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+        memcmp(header.magic, kFileMagic, sizeof(header.magic)) == 0 &&
+        valid_capacity(header.capacity, sizeof(Record)) &&
+        fstat(fd, &s) == 0 &&
+        static_cast<uint64_t>(s.st_size) ==
+            sizeof(header) + header.capacity * sizeof(Record)) {
+        capacity_ = header.capacity;
+    } else {
+        capacity_ = kMinCapacity;
+        while (capacity_ < 2 * static_cast<size_t>(params.statcachesize)) {
+            capacity_ *= 2;
+        }
+        Log(INFO) << "Initializing stats cache file with " << capacity_
+                  << " entries";
+        memcpy(header.magic, kFileMagic, sizeof(header.magic));
+        header.capacity = capacity_;
+        // Truncating to zero first clears any old records.
+        if (ftruncate(fd, 0) == -1 ||
+            ftruncate(fd, static_cast<off_t>(sizeof(header) +
+                                             capacity_ * sizeof(Record))) ==
+                -1 ||
+            pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+            Log(ERROR) << "Failed to initialize stats cache file: "
+                       << strerror(errno);
+            close(fd);
             errno = 0;
-            std::lock_guard<std::mutex> l(mutex_);
-            remove_entry(decoded_file, file_stat);
+            return false;
         }
     }
 
-    /* Remove the oldest entries until the cache size meets the target. */
-    std::lock_guard<std::mutex> l(mutex_);
-    for (const auto& e : sorted_entries) {
-        if (cache_.size() <= target_size) {
-            break;
-        }
-        Log(DEBUG) << "Pruned oldest file '" << e.first << "' from stats cache";
-        remove_entry(e.first, e.second);
+    map_size_ = sizeof(header) + capacity_ * sizeof(Record);
+    void* map = mmap(nullptr, map_size_, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        Log(ERROR) << "Failed to map stats cache file: " << strerror(errno);
+        errno = 0;
+        return false;
     }
+    map_ = map;
+    records_ = reinterpret_cast<Record*>(static_cast<char*>(map_) +
+                                         sizeof(FileHeader));
+    return true;
 }
 
 /*
- * Remove the cache entry if it exists and if the entry's file stat matches the
- * given file stat, i.e. the file stat hasn't changed.  Assumes the cache is
- * locked.
+ * Find the record with the given key in the persistent cache file. If
+ * for_write is true and there is no such record, return the slot which should
+ * be used to store it instead. Assumes the file is mapped and locked.
  */
-void StatsCache::remove_entry(const std::string& file,
-                              const FileStat& file_stat) {
-    auto it = cache_.find(file);
-    if (it != cache_.end() && it->second == file_stat) {
-        cache_.erase(it);
+StatsCache::Record* StatsCache::find_record(uint64_t key, bool for_write) {
+    Record* empty = nullptr;
+    const size_t home = key & (capacity_ - 1);
+    for (size_t i = 0; i < kMaxProbe && i < capacity_; ++i) {
+        Record* record = &records_[(home + i) & (capacity_ - 1)];
+        if (record->key == key) {
+            return record;
+        }
+        if (empty == nullptr && record->key == 0) {
+            empty = record;
+        }
+    }
+
+    if (!for_write) {
+        return nullptr;
     }
+    // If there is no room, overwrite whatever is in the first slot.
+    Record* record = empty != nullptr ? empty : &records_[home];
+    record->key = key;
+    return record;
 }
 
-StatsCache::FileStat::FileStat(size_t size, time_t mtime)
-    : size_(size), mtime_(mtime) {
-    update_atime();
+/*
+ * Load the entry for the given file from the persistent cache file into its
+ * shard. Records for other files with the same key, or computed with
+ * different encoding parameters, are ignored. Assumes the shard is locked.
+ */
+bool StatsCache::load_record(Shard* shard, uint64_t key,
+                             uint64_t name_check) {
+    std::lock_guard<std::mutex> l(file_mutex_);
+    if (!map_file()) {
+        return false;
+    }
+
+    const Record* record = find_record(key, false);
+    if (record == nullptr || record->name_check != name_check ||
+        record->params != params_hash_ ||
+        record->check != record_check(record->key, record->name_check,
+                                      record->size, record->mtime,
+                                      record->params)) {
+        return false;
+    }
+
+    insert(shard, key, name_check, record->size, record->mtime);
+    return true;
 }
 
-void StatsCache::FileStat::update_atime() {
-    atime_ = time(nullptr);
+/*
+ * Write the entry to the persistent cache file. Assumes its shard is locked.
+ */
+void StatsCache::store_record(const Entry& entry) {
+    std::lock_guard<std::mutex> l(file_mutex_);
+    if (!map_file()) {
+        return;
+    }
+
+    Record* record = find_record(entry.key, true);
+    record->name_check = entry.name_check;
+    record->size = entry.size;
+    record->mtime = entry.mtime;
+    record->params = params_hash_;
+    record->check = record_check(record->key, record->name_check,
+                                 record->size, record->mtime, record->params);
 }
 
-bool StatsCache::FileStat::operator==(const FileStat& other) const {
-    return size_ == other.size_ && atime_ == other.atime_ &&
-           mtime_ == other.mtime_;
+/*
+ * Remove the entry with the given key from the persistent cache file. Assumes
+ * its shard is locked.
+ */
+void StatsCache::remove_record(uint64_t key) {
+    std::lock_guard<std::mutex> l(file_mutex_);
+    if (!map_file()) {
+        return;
+    }
+
+    Record* record = find_record(key, false);
+    if (record != nullptr) {
+        record->key = 0;
+    }
 }
@@ -21,16 +21,24 @@
 #ifndef MP3FS_STATS_CACHE_H_
 #define MP3FS_STATS_CACHE_H_
 
+#include <cstddef>
+#include <cstdint>
 #include <ctime>
-#include <map>
 #include <mutex>
 #include <string>
-#include <utility>
+#include <unordered_map>
 
+/*
+ * Cache of output file sizes, keyed by source file name. The cache is split
+ * into shards with their own locks, so lookups from different threads rarely
+ * wait for each other. Each shard keeps its entries in a hash map and a list
+ * in order of use, so lookups, updates and evicting the least recently used
+ * entry all take constant time.
+ */
 class StatsCache {
  public:
     StatsCache() = default;
-    ~StatsCache() = default;
+    ~StatsCache();
     StatsCache(const StatsCache&) = delete;
     StatsCache& operator=(const StatsCache&) = delete;
 
@@ -38,36 +46,82 @@ class StatsCache {
                       size_t* filesize);
     void put_filesize(const std::string& filename, size_t filesize,
                       time_t mtime);
+    void remove_filesize(const std::string& filename);
 
  private:
-    /* Holds the size and modified time for a file. */
-    class FileStat {
-     public:
-        FileStat(size_t size, time_t mtime);
+    /*
+     * The size and modified time for a file. Entries are keyed by a 64-bit
+     * hash of the file name, the same as records in the persistent cache
+     * file. A second, independent hash of the name is kept too, so a file
+     * whose key collides with another file's almost never gets its size,
+     * without keeping the name itself in memory.
+     */
+    struct Entry {
+        uint64_t key;
+        uint64_t name_check;
+        uint64_t size;
+        // The modified time of the decoded file when the size was computed.
+        int64_t mtime;
+        // Neighbours in the shard's list, with the most recently used first.
+        Entry* prev;
+        Entry* next;
+    };
 
-        void update_atime();
+    struct Shard {
+        Shard() { lru.prev = lru.next = &lru; }
 
-        size_t get_size() const { return size_; }
-        time_t get_atime() const { return atime_; }
-        time_t get_mtime() const { return mtime_; }
-        bool operator==(const FileStat& other) const;
+        std::mutex mutex;
+        std::unordered_map<uint64_t, Entry> entries;
+        // Head of the circular list of entries.
+        Entry lru = {};
+    };
 
-     private:
-        size_t size_;
-        // The last time this object was accessed. Used to implement the most
-        // recently used cache policy.
-        time_t atime_ = 0;
-        // The modified time of the decoded file when the size was computed.
-        time_t mtime_;
+    /*
+     * A file size stored in the persistent cache file. The name_check field
+     * is a second hash of the file name, independent of the key, since the
+     * name is not stored. The check field is a hash of the other fields, so
+     * partially written records are ignored.
+     */
+    struct Record {
+        uint64_t key;
+        uint64_t name_check;
+        uint64_t size;
+        int64_t mtime;
+        uint32_t params;
+        uint32_t check;
     };
 
-    using cache_entry_t = std::pair<std::string, FileStat>;
+    static constexpr size_t kShards = 16;
+    static_assert(kShards == 16, "shard() takes the top 4 bits of the key");
+
+    static uint64_t Key(const std::string& filename);
+    static uint64_t NameCheck(const std::string& filename);
+    Shard& shard(uint64_t key) { return shards_[key >> 60]; }
+
+    static void Unlink(Entry* entry);
+    static void PushFront(Shard* shard, Entry* entry);
+    Entry* insert(Shard* shard, uint64_t key, uint64_t name_check,
+                  uint64_t size, int64_t mtime);
+
+    bool map_file();
+    Record* find_record(uint64_t key, bool for_write);
+    bool load_record(Shard* shard, uint64_t key, uint64_t name_check);
+    void store_record(const Entry& entry);
+    void remove_record(uint64_t key);
 
-    void prune();
-    void remove_entry(const std::string& file, const FileStat& file_stat);
+    Shard shards_[kShards];
 
-    std::map<std::string, FileStat> cache_;
-    std::mutex mutex_;
+    /*
+     * Memory map of the persistent cache file, if one is used. Locked
+     * separately from the shards, and always after a shard if both are.
+     */
+    std::mutex file_mutex_;
+    bool map_attempted_ = false;
+    void* map_ = nullptr;
+    size_t map_size_ = 0;
+    Record* records_ = nullptr;
+    size_t capacity_ = 0;
+    uint32_t params_hash_ = 0;
 };
 
 #endif  // MP3FS_STATS_CACHE_H_
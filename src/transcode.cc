@@ -21,29 +21,273 @@
 
 #include "transcode.h"
 
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
 #include <cerrno>
 #include <cstdint>
 #include <ctime>  // IWYU pragma: keep (time_t)
 #include <limits>
+#include <map>
 #include <mutex>
+#include <sstream>
+#include <utility>
 
 #include "codecs/coders.h"
+#include "file_cache.h"
 #include "logging.h"
 #include "mp3fs.h"
+#include "operations.h"
+#include "single_flight.h"
 #include "stats_cache.h"
 
 namespace {
 
+// Number of PcmBlocks buffered between the pipeline threads.
+constexpr size_t kPipelineBlocks = 64;
+
+constexpr size_t kBytesPerKilobyte = 1024;
+// Size of the encode-ahead window after the first sequential read.
+constexpr size_t kMinAheadWindow = 128 * kBytesPerKilobyte;
+// Reads starting this close to the end of the last read count as sequential,
+// since the kernel may issue neighbouring reads out of order.
+constexpr size_t kSequentialSlack = 128 * kBytesPerKilobyte;
+
 StatsCache stats_cache;
+FileCache file_cache;
+
+/*
+ * Transcoders currently open through Transcoder::OpenShared(), keyed by file
+ * name, modification time, and encoding parameters. Entries are removed when
+ * the last handle to the Transcoder is released.
+ */
+std::map<std::string, std::weak_ptr<Transcoder>> shared_transcoders;
+std::mutex shared_transcoders_mutex;
+
+/*
+ * Opening a file or computing its size for several callers at once is done
+ * only once, with the other callers waiting for the result. Otherwise a
+ * group of files being scanned by several threads is opened and read by each
+ * of them.
+ */
+SingleFlight<std::shared_ptr<Transcoder>> opening_transcoders;
+SingleFlight<ssize_t> computing_sizes;
+
+/* Reader for a single open handle of a shared Transcoder. */
+class SharedTranscoder : public Reader {
+ public:
+    explicit SharedTranscoder(std::shared_ptr<Transcoder> transcoder)
+        : transcoder_(std::move(transcoder)) {}
+
+    ssize_t read(char* buff, off_t offset, size_t len) override {
+        return transcoder_->read(buff, offset, len);
+    }
+
+    int fd() override { return transcoder_->fd(); }
+
+ private:
+    std::shared_ptr<Transcoder> transcoder_;
+};
+
+/* Create the Decoder for the given file, based on its extension. */
+std::unique_ptr<Decoder> create_decoder(const std::string& filename) {
+    size_t dot_idx = filename.rfind('.');
+    if (dot_idx == std::string::npos) {
+        return nullptr;
+    }
+    return Decoder::CreateDecoder(filename.c_str() + dot_idx + 1);
+}
+
+/*
+ * Encode one segment of seekable output with the given Decoder and Encoder,
+ * which must have had their metadata processed.
+ */
+bool encode_segment(Decoder* decoder, Encoder* encoder, size_t segment) {
+    Log(DEBUG) << "Encoding segment " << segment << ".";
+
+    uint64_t first_sample = 0;
+    if (encoder->start_segment(segment, &first_sample) == -1 ||
+        decoder->seek_sample(first_sample) == -1) {
+        Log(ERROR) << "Unable to start segment " << segment << ".";
+        return false;
+    }
+
+    while (!encoder->segment_finished()) {
+        int stat = decoder->process_single_fr(encoder);
+        if (stat == -1) {
+            return false;
+        }
+        if (stat == 1) {
+            // The segment runs to the end of the input.
+            return encoder->encode_finish() != -1 &&
+                   encoder->segment_finished();
+        }
+    }
+    return true;
+}
 
+/* Look up a live shared Transcoder. Assumes the registry is locked. */
+std::shared_ptr<Transcoder> find_shared(const std::string& key) {
+    auto it = shared_transcoders.find(key);
+    if (it == shared_transcoders.end()) {
+        return nullptr;
+    }
+    return it->second.lock();
+}
+
+/*
+ * Return the key under which the audio encoded from the given Decoder with
+ * the given Encoder is cached, or an empty string if it can't be. It holds
+ * everything which determines the audio, but not the tags, except for the
+ * gain which they may set. Unless 'read_audio' is set, decoders which must
+ * read through the file to fingerprint its audio give no key.
+ */
+std::string audio_key(Decoder* decoder, const Encoder* encoder,
+                      bool read_audio) {
+    // The key is only used for the cache.
+    if (!FileCache::enabled()) {
+        return "";
+    }
+
+    const std::string fingerprint = decoder->audio_fingerprint(read_audio);
+    if (fingerprint.empty()) {
+        return "";
+    }
+
+    std::ostringstream key;
+    key << fingerprint << '\0' << encoding_params_key() << '\0'
+        << encoder->volume_scale();
+    return key.str();
+}
+
+/*
+ * Open a Transcoder for the given file and register it under the given key
+ * to be shared. Returns nullptr and sets errno on failure.
+ */
+std::shared_ptr<Transcoder> open_shared(const std::string& filename,
+                                        const std::string& key) {
+    // The Transcoder may have been registered since the caller looked.
+    {
+        std::lock_guard<std::mutex> l(shared_transcoders_mutex);
+        std::shared_ptr<Transcoder> shared = find_shared(key);
+        if (shared) {
+            return shared;
+        }
+    }
+
+    std::shared_ptr<Transcoder> trans(
+        new Transcoder(filename), [key](Transcoder* t) {
+            {
+                std::lock_guard<std::mutex> l(shared_transcoders_mutex);
+                auto it = shared_transcoders.find(key);
+                if (it != shared_transcoders.end() && it->second.expired()) {
+                    shared_transcoders.erase(it);
+                }
+            }
+            delete t;
+        });
+    if (!trans->open()) {
+        const int open_errno = errno;
+        trans.reset();
+        errno = open_errno;
+        return nullptr;
+    }
+
+    std::lock_guard<std::mutex> l(shared_transcoders_mutex);
+    shared_transcoders[key] = trans;
+    return trans;
+}
+
+/*
+ * Compute the size of the output for the given file from its metadata.
+ * Returns -1 and sets errno on failure.
+ */
+ssize_t compute_size(const std::string& filename) {
+    std::unique_ptr<Decoder> decoder = create_decoder(filename);
+    if (!decoder || decoder->open_file(filename.c_str()) == -1) {
+        errno = EIO;
+        return -1;
+    }
+
+    /*
+     * An Encoder without a Buffer only collects the tags and stream
+     * parameters, so the metadata can be processed without setting up the
+     * encoder or decoding any audio.
+     */
+    std::unique_ptr<Encoder> encoder =
+        Encoder::CreateEncoder(params.desttype, nullptr);
+    if (!encoder || decoder->process_metadata(encoder.get()) == -1 ||
+        encoder->render_tag(0) == -1) {
+        Log(ERROR) << "Error computing size of " << filename;
+        errno = EIO;
+        return -1;
+    }
+
+    size_t size = encoder->calculate_size();
+    bool exact = params.vbr == 0;
+
+    // With the audio cached, the size is that of the audio and the tags.
+    size_t header = 0;
+    size_t trailer = 0;
+    size_t audio_size = 0;
+    // Reading a whole file to fingerprint it is left to when it is opened.
+    const std::string key = audio_key(decoder.get(), encoder.get(), false);
+    if (!key.empty() && encoder->tag_sizes(&header, &trailer) &&
+        file_cache.get_audio_size(key, &audio_size)) {
+        size = header + audio_size + trailer;
+        exact = true;
+    }
+
+    // For CBR the computed size is what encoding will produce, so remember it.
+    // For VBR it is only an estimate until the file is actually encoded.
+    if (params.statcachesize > 0 && exact) {
+        stats_cache.put_filesize(filename, size, decoder->mtime());
+    }
+    Decoder::Recycle(std::move(decoder));
+
+    return static_cast<ssize_t>(size);
+}
+
+}  // namespace
+
+std::unique_ptr<Reader> Transcoder::OpenShared(const std::string& filename) {
+    struct stat s = {};
+    if (stat(filename.c_str(), &s) == -1) {
+        return nullptr;
+    }
+
+    // Finished output in the on-disk cache can be read directly.
+    int fd = file_cache.open_entry(filename, s.st_mtime);
+    if (fd != -1) {
+        return std::unique_ptr<Reader>(new FileReader(fd));
+    }
+
+    std::ostringstream key_stream;
+    key_stream << filename << '\0' << s.st_mtime << '\0'
+               << encoding_params_key();
+    const std::string key = key_stream.str();
+
+    {
+        std::lock_guard<std::mutex> l(shared_transcoders_mutex);
+        std::shared_ptr<Transcoder> shared = find_shared(key);
+        if (shared) {
+            Log(DEBUG) << "Sharing open transcoder for " << filename;
+            return std::unique_ptr<Reader>(new SharedTranscoder(shared));
+        }
+    }
+
+    std::shared_ptr<Transcoder> trans = opening_transcoders.run(
+        key, [&filename, &key] { return open_shared(filename, key); });
+    if (!trans) {
+        return nullptr;
+    }
+    return std::unique_ptr<Reader>(new SharedTranscoder(std::move(trans)));
 }
 
 bool Transcoder::open() {
     /* Create Encoder and Decoder objects. */
-    size_t dot_idx = filename_.rfind('.');
-    if (dot_idx != std::string::npos) {
-        decoder_ = Decoder::CreateDecoder(filename_.substr(dot_idx + 1));
-    }
+    decoder_ = create_decoder(filename_);
     if (!decoder_) {
         errno = EIO;
         return false;
@@ -64,11 +308,22 @@ bool Transcoder::open() {
         return false;
     }
 
+    /*
+     * With the pipeline, the Decoder passes audio through a PcmRing to be
+     * encoded on another thread.
+     */
+    Encoder* decoder_output = encoder_.get();
+    if (params.pipeline != 0) {
+        pcm_ring_.reset(new PcmRing(kPipelineBlocks));
+        ring_encoder_.reset(new RingEncoder(encoder_.get(), pcm_ring_.get()));
+        decoder_output = ring_encoder_.get();
+    }
+
     /*
      * Process metadata. The Decoder will call the Encoder to set appropriate
      * tag values for the output file.
      */
-    if (decoder_->process_metadata(encoder_.get()) == -1) {
+    if (decoder_->process_metadata(decoder_output) == -1) {
         Log(ERROR) << "Error processing metadata.";
         errno = EIO;
         return false;
@@ -87,29 +342,148 @@ bool Transcoder::open() {
 
     Log(DEBUG) << "Tag written to Buffer.";
 
+    audio_key_ = audio_key(decoder_.get(), encoder_.get(), true);
+    if (load_cached_audio()) {
+        return true;
+    }
+
+    segment_offsets_ = encoder_->segment_offsets();
+    if (!segment_offsets_.empty()) {
+        segments_remaining_ = segment_offsets_.size() - 1;
+        segment_states_.assign(segments_remaining_, SegmentState::kMissing);
+        Log(DEBUG) << "Output has " << segments_remaining_ << " segments.";
+    }
+
+    // Segments are written in any order, and output which can't be read
+    // partially is not final until it is finished.
+    partial_reads_ =
+        segment_offsets_.empty() && !encoder_->no_partial_encode();
+    encoder_->final_range(&final_offset_, &final_size_);
+
     return true;
 }
 
-ssize_t Transcoder::read(char* buff, off_t offset, size_t len) {
+Transcoder::~Transcoder() {
+    {
+        std::lock_guard<std::mutex> l(mutex_);
+        stopping_ = true;
+        encoding_changed_.notify_all();
+    }
+    if (pcm_ring_) {
+        pcm_ring_->close();
+    }
+    if (decoder_thread_.joinable()) {
+        decoder_thread_.join();
+        encoder_thread_.join();
+    }
+    if (ahead_thread_.joinable()) {
+        ahead_thread_.join();
+    }
+    for (auto& thread : encode_threads_) {
+        thread.join();
+    }
+    Decoder::Recycle(std::move(decoder_));
+    if (output_fd_ != -1) {
+        close(output_fd_);
+    }
+}
+
+int Transcoder::fd() {
     std::lock_guard<std::mutex> l(mutex_);
+    return output_fd_;
+}
+
+bool Transcoder::GetSize(const std::string& filename, time_t mtime,
+                         size_t* size) {
+    if (file_cache.get_size(filename, mtime, size) ||
+        stats_cache.get_filesize(filename, mtime, size)) {
+        return true;
+    }
+
+    std::ostringstream key;
+    key << filename << '\0' << mtime;
+    const ssize_t computed = computing_sizes.run(
+        key.str(), [&filename] { return compute_size(filename); });
+    if (computed == -1) {
+        return false;
+    }
+
+    *size = static_cast<size_t>(computed);
+    return true;
+}
+
+void Transcoder::ForgetSource(const std::string& filename) {
+    stats_cache.remove_filesize(filename);
+}
+
+bool Transcoder::read_spans(off_t offset, size_t len,
+                            const span_callback_t& callback) {
+    if (!readable(offset, len) ||
+        !buffer_.visit_valid(offset, len, callback)) {
+        return false;
+    }
+    if (params.encodeahead != 0) {
+        std::lock_guard<std::mutex> l(mutex_);
+        update_encode_target(offset, len);
+    }
+    return true;
+}
+
+ssize_t Transcoder::read(char* buff, off_t offset, size_t len) {
     Log(DEBUG) << "Reading " << len << " bytes from offset " << offset << ".";
+
+    // Data which has already been encoded is copied out without waiting for
+    // reads which are encoding more.
+    if (readable(offset, len) &&
+        buffer_.copy_valid(reinterpret_cast<uint8_t*>(buff), offset, len)) {
+        if (params.encodeahead != 0) {
+            std::lock_guard<std::mutex> l(mutex_);
+            update_encode_target(offset, len);
+        }
+        return static_cast<ssize_t>(len);
+    }
+
+    std::unique_lock<std::mutex> l(mutex_);
     if (static_cast<size_t>(offset) > get_size()) {
         return 0;
     }
 
+    // Seekable output only needs the segments covering the requested range.
+    if (!segment_offsets_.empty()) {
+        len = std::min(len, get_size() - static_cast<size_t>(offset));
+        if (!encode_segments(&l, offset, len)) {
+            errno = EIO;
+            return -1;
+        }
+        buffer_.copy_into(reinterpret_cast<uint8_t*>(buff), offset, len);
+        return static_cast<ssize_t>(len);
+    }
+
+    update_encode_target(offset, len);
+
     // If the requested data has already been filled into the buffer, simply
-    // copy it out.
-    if (buffer_.valid_bytes(offset, len)) {
+    // copy it out. Output which can't be read partially may be in the Buffer
+    // while another thread is still encoding it.
+    if (readable(offset, len) && buffer_.valid_bytes(offset, len)) {
         buffer_.copy_into(reinterpret_cast<uint8_t*>(buff), offset, len);
         return static_cast<ssize_t>(len);
     }
 
-    while (decoder_ && encoder_ &&
-           buffer_.tell() < (encoder_->no_partial_encode()
-                                 ? std::numeric_limits<size_t>::max()
-                                 : offset + len)) {
-        int stat = decoder_->process_single_fr(encoder_.get());
-        if (stat == -1 || (stat == 1 && !finish())) {
+    // Otherwise encode as far as the end of the range, or to the end of the
+    // file if the range isn't final until then.
+    const size_t encode_end = readable(offset, len)
+                                  ? offset + len
+                                  : std::numeric_limits<size_t>::max();
+    if (pcm_ring_) {
+        if (!wait_for_pipeline(&l, encode_end)) {
+            errno = EIO;
+            return -1;
+        }
+    }
+
+    while (!pcm_ring_ && decoder_ && encoder_ &&
+           buffer_.tell() < encode_end) {
+        if (!encode_frame(&l)) {
             errno = EIO;
             return -1;
         }
@@ -132,12 +506,13 @@ bool Transcoder::finish() {
     time_t decoded_file_mtime = 0;
     if (decoder_) {
         decoded_file_mtime = decoder_->mtime();
-        decoder_.reset(nullptr);
+        Decoder::Recycle(std::move(decoder_));
     }
 
     // Encoder cleanup
     if (encoder_) {
-        if (encoder_->encode_finish() == -1) {
+        // Segments are finished as they are encoded.
+        if (segment_offsets_.empty() && encoder_->encode_finish() == -1) {
             return false;
         }
 
@@ -145,12 +520,360 @@ bool Transcoder::finish() {
         Log(DEBUG) << "Finishing file. Predicted size: "
                    << encoder_->calculate_size()
                    << ", final size: " << buffer_.size();
+
+        // Keep the audio apart from the tags too, so the output can be put
+        // together again if only the tags change.
+        size_t header = 0;
+        size_t trailer = 0;
+        if (!audio_key_.empty() && encoder_->tag_sizes(&header, &trailer) &&
+            buffer_.size() >= header + trailer) {
+            file_cache.put_audio(audio_key_, buffer_, header,
+                                 buffer_.size() - trailer);
+        }
         encoder_.reset(nullptr);
     }
 
+    store_output(decoded_file_mtime);
+    return true;
+}
+
+void Transcoder::store_output(time_t mtime) {
     if (params.statcachesize > 0 && buffer_.size() != 0) {
-        stats_cache.put_filesize(filename_, buffer_.size(), decoded_file_mtime);
+        stats_cache.put_filesize(filename_, buffer_.size(), mtime);
+    }
+
+    file_cache.put_entry(filename_, mtime, buffer_);
+    output_fd_ = file_cache.open_entry(filename_, mtime);
+    finished_ = true;
+
+    // Cached attributes may hold a size estimated before encoding.
+    mp3fs_forget_output_attributes(filename_);
+}
+
+bool Transcoder::load_cached_audio() {
+    size_t header = 0;
+    size_t trailer = 0;
+    if (audio_key_.empty() || !encoder_->tag_sizes(&header, &trailer)) {
+        return false;
+    }
+
+    const int fd = file_cache.open_audio(audio_key_);
+    if (fd == -1) {
+        return false;
+    }
+
+    // Read all of it before touching the Buffer, so a failure leaves the
+    // Buffer ready for encoding.
+    struct stat s = {};
+    std::vector<uint8_t> audio;
+    bool ok = fstat(fd, &s) == 0;
+    if (ok) {
+        audio.resize(static_cast<size_t>(s.st_size));
+        ok = pread(fd, audio.data(), audio.size(), 0) ==
+             static_cast<ssize_t>(audio.size());
+    }
+    close(fd);
+    if (!ok) {
+        Log(ERROR) << "Failed to read cached audio for " << filename_;
+        errno = 0;
+        return false;
+    }
+
+    Log(DEBUG) << "Using cached audio for " << filename_;
+    buffer_.write_to(audio, static_cast<std::ptrdiff_t>(header));
+    buffer_.truncate();
+
+    const time_t mtime = decoder_->mtime();
+    Decoder::Recycle(std::move(decoder_));
+    encoder_.reset(nullptr);
+    store_output(mtime);
+    return true;
+}
+
+bool Transcoder::encode_segments(std::unique_lock<std::mutex>* lock,
+                                 off_t offset, size_t len) {
+    // The tags are written when the Transcoder is opened.
+    if (segments_remaining_ == 0 || len == 0 ||
+        static_cast<size_t>(offset) >= segment_offsets_.back() ||
+        offset + len <= segment_offsets_.front()) {
+        return true;
     }
 
+    if (params.encodethreads > 0 && encode_threads_.empty()) {
+        Log(DEBUG) << "Starting " << params.encodethreads
+                   << " encoder threads for " << filename_;
+        for (unsigned int i = 0; i < params.encodethreads; ++i) {
+            encode_threads_.emplace_back(&Transcoder::encode_thread, this);
+        }
+    }
+
+    // Find the segments containing the first and last bytes of the range.
+    auto first = std::upper_bound(segment_offsets_.begin() + 1,
+                                  segment_offsets_.end() - 1,
+                                  static_cast<size_t>(offset));
+    auto last = std::upper_bound(first, segment_offsets_.end() - 1,
+                                 offset + len - 1);
+    for (auto it = first; it <= last; ++it) {
+        const auto segment =
+            static_cast<size_t>(it - segment_offsets_.begin() - 1);
+        segment_changed_.wait(*lock, [this, segment] {
+            return segment_states_[segment] != SegmentState::kEncoding;
+        });
+        if (segment_states_[segment] == SegmentState::kDone) {
+            continue;
+        }
+
+        // Encode segments nobody else is working on right away, rather than
+        // waiting for the encoder threads to get to them. Other reads may use
+        // the lock meanwhile, but only one at a time can use the Decoder.
+        segment_states_[segment] = SegmentState::kEncoding;
+        encoding_changed_.wait(*lock, [this] { return !encoding_; });
+        encoding_ = true;
+        lock->unlock();
+        const bool encoded =
+            encode_segment(decoder_.get(), encoder_.get(), segment);
+        lock->lock();
+        encoding_ = false;
+        encoding_changed_.notify_all();
+
+        if (!encoded) {
+            Log(ERROR) << "Error encoding " << filename_;
+            segment_states_[segment] = SegmentState::kMissing;
+            segment_changed_.notify_all();
+            return false;
+        }
+        if (!segment_done(segment)) {
+            return false;
+        }
+    }
     return true;
 }
+
+bool Transcoder::readable(off_t offset, size_t len) const {
+    if (finished_) {
+        return true;
+    }
+    const auto start = static_cast<size_t>(offset);
+    return partial_reads_ &&
+           (start + len <= final_offset_ ||
+            start >= final_offset_ + final_size_);
+}
+
+bool Transcoder::encode_frame(std::unique_lock<std::mutex>* lock) {
+    if (encoding_) {
+        encoding_changed_.wait(*lock);
+        return true;
+    }
+
+    encoding_ = true;
+    lock->unlock();
+    const int stat = decoder_->process_single_fr(encoder_.get());
+    lock->lock();
+
+    const bool ok = stat != -1 && (stat != 1 || finish());
+    encoding_ = false;
+    encoding_changed_.notify_all();
+    return ok;
+}
+
+bool Transcoder::segment_done(size_t segment) {
+    segment_states_[segment] = SegmentState::kDone;
+    segment_changed_.notify_all();
+    if (--segments_remaining_ == 0) {
+        return finish();
+    }
+    return true;
+}
+
+/*
+ * Encode segments in order from the start of the file, in parallel with
+ * reads and the other encoder threads. Each thread needs its own Decoder and
+ * Encoder, which share the Transcoder's Buffer. Since segments never overlap,
+ * they are written without holding the lock.
+ */
+void Transcoder::encode_thread() {
+    std::unique_ptr<Decoder> decoder = create_decoder(filename_);
+    std::unique_ptr<Encoder> encoder =
+        Encoder::CreateEncoder(params.desttype, &buffer_);
+    if (!decoder || !encoder || decoder->open_file(filename_.c_str()) == -1 ||
+        decoder->process_metadata(encoder.get()) == -1 ||
+        encoder->prepare_segments() == -1 ||
+        encoder->segment_offsets() != segment_offsets_) {
+        Log(ERROR) << "Unable to start encoder thread for " << filename_;
+        return;
+    }
+
+    std::unique_lock<std::mutex> l(mutex_);
+    while (!stopping_ && segments_remaining_ > 0) {
+        while (next_segment_ < segment_states_.size() &&
+               segment_states_[next_segment_] != SegmentState::kMissing) {
+            ++next_segment_;
+        }
+        if (next_segment_ == segment_states_.size()) {
+            break;
+        }
+
+        const size_t segment = next_segment_;
+        segment_states_[segment] = SegmentState::kEncoding;
+        l.unlock();
+        const bool encoded =
+            encode_segment(decoder.get(), encoder.get(), segment);
+        l.lock();
+
+        if (!encoded) {
+            // Leave the segment to be encoded by a read, which can report
+            // the error.
+            segment_states_[segment] = SegmentState::kMissing;
+            segment_changed_.notify_all();
+            break;
+        }
+        if (!segment_done(segment)) {
+            break;
+        }
+    }
+    l.unlock();
+    Decoder::Recycle(std::move(decoder));
+}
+
+bool Transcoder::wait_for_pipeline(std::unique_lock<std::mutex>* lock,
+                                   size_t end) {
+    if (!encoder_) {
+        return !pipeline_failed_;
+    }
+
+    encode_target_ = std::max(encode_target_, end);
+    start_pipeline();
+    encoding_changed_.notify_all();
+
+    encoding_changed_.wait(*lock, [this, end] {
+        return pipeline_failed_ || !encoder_ || buffer_.tell() >= end;
+    });
+    return !pipeline_failed_;
+}
+
+/*
+ * The encode-ahead window doubles with each sequential read, up to the
+ * encodeahead option, so a file being streamed is encoded before it is read.
+ * A read anywhere else closes the window, so random access doesn't encode
+ * data nobody reads. Once reads stop, so does encoding, at the end of the
+ * window.
+ */
+void Transcoder::update_encode_target(off_t offset, size_t len) {
+    if (params.encodeahead == 0 || !encoder_) {
+        return;
+    }
+
+    const auto start = static_cast<size_t>(offset);
+    if (start + kSequentialSlack >= last_read_end_ &&
+        start <= last_read_end_ + kSequentialSlack) {
+        ahead_window_ =
+            std::min(static_cast<size_t>(params.encodeahead) *
+                         kBytesPerKilobyte,
+                     std::max(kMinAheadWindow, 2 * ahead_window_));
+    } else {
+        ahead_window_ = 0;
+    }
+    last_read_end_ = start + len;
+
+    if (last_read_end_ + ahead_window_ <= encode_target_) {
+        return;
+    }
+    encode_target_ = last_read_end_ + ahead_window_;
+    if (pcm_ring_) {
+        start_pipeline();
+    } else if (!ahead_thread_.joinable()) {
+        ahead_thread_ = std::thread(&Transcoder::run_encode_ahead, this);
+    }
+    encoding_changed_.notify_all();
+}
+
+void Transcoder::start_pipeline() {
+    if (!decoder_thread_.joinable()) {
+        decoder_thread_ = std::thread(&Transcoder::run_decoder, this);
+        encoder_thread_ = std::thread(&Transcoder::run_encoder, this);
+    }
+}
+
+/*
+ * Encode one frame at a time, taking turns with reads which need to encode.
+ * An error is left for the next read to run into and report.
+ */
+void Transcoder::run_encode_ahead() {
+    std::unique_lock<std::mutex> l(mutex_);
+    while (true) {
+        encoding_changed_.wait(l, [this] {
+            return stopping_ || !decoder_ || !encoder_ ||
+                   buffer_.tell() < encode_target_;
+        });
+        if (stopping_ || !decoder_ || !encoder_) {
+            break;
+        }
+
+        if (!encode_frame(&l)) {
+            Log(ERROR) << "Error encoding ahead in " << filename_;
+            break;
+        }
+    }
+}
+
+/*
+ * The decoder thread owns the Decoder until it has queued the end of the
+ * input, and never touches the Buffer, so it runs without the lock.
+ */
+void Transcoder::run_decoder() {
+    int stat = 0;
+    while (stat == 0) {
+        stat = decoder_->process_single_fr(ring_encoder_.get());
+    }
+    ring_encoder_->push_end(stat);
+}
+
+/*
+ * The encoder thread is the only user of the Encoder until it finishes the
+ * output, and the Buffer has its own lock, so blocks are encoded without the
+ * lock, like in encode_frame().
+ */
+void Transcoder::run_encoder() {
+    std::unique_lock<std::mutex> l(mutex_);
+    while (true) {
+        encoding_changed_.wait(l, [this] {
+            return stopping_ || buffer_.tell() < encode_target_;
+        });
+        if (stopping_) {
+            break;
+        }
+
+        l.unlock();
+        PcmBlock* block = pcm_ring_->begin_pop();
+        l.lock();
+        if (block == nullptr) {
+            break;
+        }
+
+        bool ok;
+        const bool end = block->status != 0;
+        if (!end) {
+            std::vector<const int32_t*> data(block->channels);
+            for (unsigned int i = 0; i < block->channels; ++i) {
+                data[i] = &block->samples[i * block->numsamples];
+            }
+            l.unlock();
+            ok = encoder_->encode_pcm_data(data.data(), block->numsamples,
+                                           block->sample_size) != -1;
+            l.lock();
+        } else {
+            ok = block->status == 1 && finish();
+        }
+        pcm_ring_->end_pop();
+
+        if (!ok) {
+            Log(ERROR) << "Error encoding " << filename_;
+            pipeline_failed_ = true;
+            pcm_ring_->close();
+        }
+        encoding_changed_.notify_all();
+        if (!ok || end) {
+            break;
+        }
+    }
+}
@@ -24,15 +24,21 @@
 
 #include <sys/types.h>
 
+#include <atomic>
+#include <condition_variable>
 #include <cstddef>
+#include <ctime>
 #include <memory>
 #include <mutex>
 #include <ostream>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include "buffer.h"
 #include "codecs/coders.h"
 #include "logging.h"
+#include "pcm_ring.h"
 #include "reader.h"
 
 /* Transcoder for open file */
@@ -42,7 +48,30 @@ class Transcoder : public Reader {
         Log(DEBUG) << "Creating transcoder object for " << filename;
     }
 
-    ~Transcoder() override = default;
+    ~Transcoder() override;
+
+    /**
+     * Open the given file for transcoding, sharing the Transcoder with any
+     * other open handles for the same file, modification time, and encoding
+     * parameters. The Transcoder is freed when the last handle is deleted.
+     * Returns nullptr and sets errno on failure.
+     */
+    static std::unique_ptr<Reader> OpenShared(const std::string& filename);
+
+    /**
+     * Get the size of the output for the given file, which has the given
+     * modification time. This does not encode anything: the size comes from
+     * the caches, or is computed from the stream parameters and tags alone.
+     * Returns false and sets errno on failure.
+     */
+    static bool GetSize(const std::string& filename, time_t mtime,
+                        size_t* size);
+
+    /**
+     * Drop the cached size for the given file, after it was changed or
+     * removed.
+     */
+    static void ForgetSource(const std::string& filename);
 
     /** Initialize the transcoder. This is equivalent of a file open. */
     bool open();
@@ -50,6 +79,16 @@ class Transcoder : public Reader {
     /** Read bytes into the internal buffer and into the given buffer. */
     ssize_t read(char* buff, off_t offset, size_t len) override;
 
+    /**
+     * Once the output is finished and stored in the transcode cache, return
+     * the cache entry, so it can be read without going through the Buffer.
+     */
+    int fd() override;
+
+    /** Pass data which has already been encoded without copying it. */
+    bool read_spans(off_t offset, size_t len,
+                    const span_callback_t& callback) override;
+
     /** Return size of output file, as computed by Encoder. */
     size_t get_size() const { return buffer_.size(); }
 
@@ -57,12 +96,140 @@ class Transcoder : public Reader {
     /** Close the input file and free everything but the buffer. */
     bool finish();
 
+    /**
+     * Store the size and the contents of the finished output in the caches,
+     * for a source file with the given modified time.
+     */
+    void store_output(time_t mtime);
+
+    /**
+     * Finish the output with the audio cached for the same input and
+     * encoding, after the rendered tags, without encoding anything. Returns
+     * false if there is none.
+     */
+    bool load_cached_audio();
+
+    /**
+     * Encode any segments overlapping the given range which are missing, or
+     * wait for the encoder threads to finish them. Assumes the Transcoder is
+     * locked with the given lock.
+     */
+    bool encode_segments(std::unique_lock<std::mutex>* lock, off_t offset,
+                         size_t len);
+
+    /**
+     * Return whether the given range can be copied from the Buffer as soon
+     * as it is valid. This doesn't need the lock.
+     */
+    bool readable(off_t offset, size_t len) const;
+
+    /**
+     * Encode the next frame with the Transcoder's own Decoder and Encoder,
+     * without holding the lock, so reads of data which is ready don't wait
+     * for it. If another thread is encoding, wait for it to finish a frame
+     * instead, after which the caller should check whether it still needs to
+     * encode. Assumes the Transcoder is locked with the given lock. Returns
+     * false on error.
+     */
+    bool encode_frame(std::unique_lock<std::mutex>* lock);
+
+    /** Record that a segment is in the Buffer. Assumes the lock is held. */
+    bool segment_done(size_t segment);
+
+    /** Encode segments on a separate thread, with its own Decoder/Encoder. */
+    void encode_thread();
+
+    /**
+     * Have the pipeline threads encode up to the given offset, and wait for
+     * them. Assumes the Transcoder is locked with the given lock.
+     */
+    bool wait_for_pipeline(std::unique_lock<std::mutex>* lock, size_t end);
+
+    /**
+     * Record a read of the given range and move encode_target_ to the end of
+     * the encode-ahead window after it, starting the threads which encode in
+     * the background if needed. Assumes the Transcoder is locked.
+     */
+    void update_encode_target(off_t offset, size_t len);
+
+    /** Start the pipeline threads if they are not running. */
+    void start_pipeline();
+
+    /** Encode up to encode_target_ in the background, without the pipeline. */
+    void run_encode_ahead();
+
+    /** Decode the whole input into the PcmRing. */
+    void run_decoder();
+
+    /** Encode blocks from the PcmRing as far as needed by reads. */
+    void run_encoder();
+
     Buffer buffer_;
     std::string filename_;
 
+    // The transcode cache entry for the finished output, if there is one.
+    int output_fd_ = -1;
+
     std::unique_ptr<Encoder> encoder_;
     std::unique_ptr<Decoder> decoder_;
 
+    // The key of the audio in the transcode cache, if it can be cached.
+    std::string audio_key_;
+
+    enum class SegmentState { kMissing, kEncoding, kDone };
+
+    /*
+     * For seekable output, the offsets of the segments which can be encoded
+     * independently, and the state of each of them. Encoder threads take the
+     * first missing segment at or after next_segment_.
+     */
+    std::vector<size_t> segment_offsets_;
+    std::vector<SegmentState> segment_states_;
+    size_t segments_remaining_ = 0;
+    size_t next_segment_ = 0;
+    std::condition_variable segment_changed_;
+
+    std::vector<std::thread> encode_threads_;
+    bool stopping_ = false;
+
+    // Whether a thread is using decoder_ and encoder_ without the lock.
+    bool encoding_ = false;
+
+    /*
+     * Whether the valid bytes of the Buffer can be read before the output is
+     * finished, without the lock. They can't when segments are encoded, or
+     * the Encoder doesn't support partial reads. Even then, the range given
+     * by Encoder::final_range() is only written at the end. These are set
+     * when the Transcoder is opened.
+     */
+    bool partial_reads_ = false;
+    size_t final_offset_ = 0;
+    size_t final_size_ = 0;
+    std::atomic<bool> finished_{false};
+
+    /*
+     * With the pipeline option, decoding and encoding run on separate
+     * threads connected by a PcmRing. The encoder thread stops once the
+     * Buffer reaches encode_target_, and the decoder thread stops when the
+     * ring is full.
+     */
+    std::unique_ptr<PcmRing> pcm_ring_;
+    std::unique_ptr<RingEncoder> ring_encoder_;
+    std::thread decoder_thread_;
+    std::thread encoder_thread_;
+    size_t encode_target_ = 0;
+    bool pipeline_failed_ = false;
+    std::condition_variable encoding_changed_;
+
+    /*
+     * With the encodeahead option, encode_target_ is kept ahead_window_ bytes
+     * past the end of the last read. Without the pipeline, ahead_thread_
+     * does the encoding.
+     */
+    size_t last_read_end_ = 0;
+    size_t ahead_window_ = 0;
+    std::thread ahead_thread_;
+
     std::mutex mutex_;
 };
 
@@ -1,18 +1,22 @@
 #include <fcntl.h>
 #include <unistd.h>
 
+#include <chrono>
 #include <cstdlib>
+#include <iostream>
 #include <thread>
 #include <vector>
 
 int fd;
 
-void read_from_offset(int off) {
+/* Read from the given offset, and store when the read finished. */
+void read_from_offset(int off, std::chrono::steady_clock::time_point* done) {
     const int buffer_size = 10000;
     char buffer[buffer_size];
     if (pread(fd, buffer, sizeof(buffer), off) == -1) {
         exit(1);
     }
+    *done = std::chrono::steady_clock::now();
 }
 
 int main(int argc, char* argv[]) {
@@ -26,12 +30,30 @@ int main(int argc, char* argv[]) {
     std::vector<std::thread> threads;
     int count = 4;
     const int interval = 30000;
-    for (int off = 0; off < count * interval; off += interval) {
-        threads.emplace_back(read_from_offset, off);
+    const auto start = std::chrono::steady_clock::now();
+    std::vector<std::chrono::steady_clock::time_point> done(count);
+    for (int i = 0; i < count; ++i) {
+        threads.emplace_back(read_from_offset, i * interval, &done[i]);
     }
     for (auto& t : threads) {
         t.join();
     }
     close(fd);
+
+    for (int i = 0; i < count; ++i) {
+        std::cout << "offset " << i * interval << ": done after "
+                  << std::chrono::duration_cast<std::chrono::microseconds>(
+                         done[i] - start)
+                         .count()
+                  << " us" << std::endl;
+    }
+
+    // The read at the start of the file only needs data which is encoded
+    // first, so it should finish before the encoder reaches the last offset.
+    if (done[0] >= done[count - 1]) {
+        std::cout << "the read at the start waited for later data"
+                  << std::endl;
+        return 1;
+    }
     return 0;
 }
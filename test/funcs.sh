@@ -23,6 +23,8 @@ cleanup () {
     set +e
     hash fusermount 2>&- && fusermount -u "$DIRNAME" || umount "$DIRNAME"
     rmdir "$DIRNAME"
+    [ -z "$CACHEDIR" ] || rm -rf "$CACHEDIR"
+    [ -z "$SRCCOPY" ] || rm -rf "$SRCCOPY"
     exit $EXIT
 }
 
@@ -34,9 +36,10 @@ set -e
 trap cleanup EXIT
 trap mp3fserr USR1
 
-SRCDIR="$( cd "${BASH_SOURCE%/*}/srcdir" && pwd )"
+# A test may set SRCCOPY to a copy of the source directory it can change.
+SRCDIR="${SRCCOPY:-$( cd "${BASH_SOURCE%/*}/srcdir" && pwd )}"
 DIRNAME="$(mktemp -d)"
-( mp3fs -d "$SRCDIR" "$DIRNAME" --logfile=$0.builtin.log || kill -USR1 $$ ) &
+( mp3fs -d "$SRCDIR" "$DIRNAME" --logfile=$0.builtin.log "${MP3FS_ARGS[@]}" || kill -USR1 $$ ) &
 while ! mount | grep -q "$DIRNAME" ; do
     sleep 0.1
 done